@@ -1,39 +1,33 @@
 #define _POSIX_C_SOURCE 200809L
 
 #include <errno.h>
+#include <math.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
-#include <sys/timerfd.h>
+#include <string.h>
+#include <time.h>
+#include "viewporter-client-protocol.h"
 #include "oguri.h"
 #include "buffers.h"
+#include "cache.h"
 #include "output.h"
+#include "probe.h"
+#include "resample.h"
+#include "rle.h"
+#include "timers.h"
+#include "workers.h"
 #include "animation.h"
 
-static bool set_timer_milliseconds(int timer_fd, unsigned int delay) {
-	struct itimerspec spec = {
-		.it_value = (struct timespec) {
-			.tv_sec = delay / 1000,
-			.tv_nsec = (delay % 1000) * (long)1000000,
-		},
-	};
-	int ret = timerfd_settime(timer_fd, 0, &spec, NULL);
-	if (ret < 0) {
-		fprintf(stderr, "Timer error (fd %d): %s\n", timer_fd, strerror(errno));
-		return false;
-	}
-
-	return true;
-}
-
-static void scale_image_onto(
-		cairo_t * cairo,
+// Works out how the source image maps onto an area of the given size,
+// according to the output's scaling mode and anchor.
+static void get_resample_params(
+		struct oguri_output * output,
 		cairo_surface_t * source,
-		struct oguri_output * output) {
-	// TODO: Store scaled width/height on buffer so we only need to pass config
-	int32_t buffer_width = output->width * output->scale;
-	int32_t buffer_height = output->height * output->scale;
+		int32_t buffer_width,
+		int32_t buffer_height,
+		struct oguri_resample_params * params) {
 	int anchor = output->config->anchor;
-	cairo_filter_t filter = output->config->filter;
 
 	double width = cairo_image_surface_get_width(source);
 	double height = cairo_image_surface_get_height(source);
@@ -41,16 +35,11 @@ static void scale_image_onto(
 	double window_ratio = (double)buffer_width / buffer_height;
 	double bg_ratio = width / height;
 
-	cairo_save(cairo);
-
-	cairo_matrix_t matrix;
-	cairo_matrix_init_identity(&matrix);
-	cairo_pattern_t * pattern = cairo_pattern_create_for_surface(source);
-
 	double scale_x = 0.0;
 	double scale_y = 0.0;
 	double offset_x = 0.0;
 	double offset_y = 0.0;
+	bool repeat = false;
 
 	switch (output->config->scaling_mode) {
 	case SCALING_MODE_FILL:
@@ -86,7 +75,7 @@ static void scale_image_onto(
 		break;
 	case SCALING_MODE_TILE:
 		scale_x = scale_y = (double)output->scale;
-		cairo_pattern_set_extend(pattern, CAIRO_EXTEND_REPEAT);
+		repeat = true;
 
 		if (anchor & ANCHOR_LEFT) {
 			offset_x = 0.0;
@@ -111,117 +100,1562 @@ static void scale_image_onto(
 		break;
 	}
 
-	cairo_matrix_translate(&matrix, -offset_x, -offset_y);
-	cairo_matrix_scale(&matrix, 1 / scale_x, 1 / scale_y);
+	*params = (struct oguri_resample_params) {
+		.source_width = width,
+		.source_height = height,
+		.target_width = buffer_width,
+		.target_height = buffer_height,
+		.scale_x = scale_x,
+		.scale_y = scale_y,
+		.offset_x = offset_x,
+		.offset_y = offset_y,
+		.filter = output->config->filter,
+		.repeat = repeat,
+	};
+}
+
+// If we couldn't build the taps (most likely out of memory), cairo can still
+// do the job, just more slowly.
+static void scale_image_with_cairo(cairo_surface_t * target,
+		const struct oguri_resample_params * params,
+		cairo_surface_t * source) {
+	cairo_t * cairo = cairo_create(target);
+
+	cairo_matrix_t matrix;
+	cairo_matrix_init_identity(&matrix);
+	cairo_pattern_t * pattern = cairo_pattern_create_for_surface(source);
+	if (params->repeat) {
+		cairo_pattern_set_extend(pattern, CAIRO_EXTEND_REPEAT);
+	}
+
+	cairo_matrix_translate(&matrix, -params->offset_x, -params->offset_y);
+	cairo_matrix_scale(&matrix, 1 / params->scale_x, 1 / params->scale_y);
 	cairo_pattern_set_matrix(pattern, &matrix);
-	cairo_pattern_set_filter(pattern, filter);
+	cairo_pattern_set_filter(pattern, params->filter);
+	cairo_set_operator(cairo, CAIRO_OPERATOR_SOURCE);
 	cairo_set_source(cairo, pattern);
 	cairo_paint(cairo);
 	cairo_pattern_destroy(pattern);
+	cairo_destroy(cairo);
+}
 
-	cairo_restore(cairo);
+static void set_buffer_scale(struct oguri_output * output, int32_t scale) {
+	if (output->buffer_scale != scale) {
+		wl_surface_set_buffer_scale(output->surface, scale);
+		output->buffer_scale = scale;
+	}
 }
 
-int oguri_render_frame(struct oguri_animation * anim) {
-	bool advanced = gdk_pixbuf_animation_iter_advance(anim->frame_iter, NULL);
-	GdkPixbuf * image = gdk_pixbuf_animation_iter_get_pixbuf(anim->frame_iter);
+// When the compositor is doing the scaling, the buffer holds the frame at its
+// native size, and the viewport crops it and stretches it over the surface.
+// Otherwise, make sure any viewport from before is gone. Since this happens
+// for every frame, but hardly ever changes anything, only what's different
+// from last time is sent.
+static void update_viewport(
+		struct oguri_output * output, cairo_surface_t * source) {
+	if (!oguri_output_uses_viewport(output)) {
+		if (output->viewport) {
+			wp_viewport_destroy(output->viewport);
+			output->viewport = NULL;
+		}
+		set_buffer_scale(output, output->scale);
+		return;
+	}
 
-	// If we've got another frame to display, update our timer. Note that while
-	// it isn't documented, the various implementations of this function take
-	// into account the elapsed time of the current frame. This means we can
-	// safely schedule frames early to redraw when new outputs appear without
-	// worrying about the timing of the next frame being wrong.
-	int delay = gdk_pixbuf_animation_iter_get_delay_time(anim->frame_iter);
-	oguri_animation_schedule_frame(anim, delay);
+	if (!output->viewport) {
+		output->viewport = wp_viewporter_get_viewport(
+				output->oguri->viewporter, output->surface);
+		for (int i = 0; i < 4; ++i) {
+			output->viewport_source[i] = -1;
+		}
+		output->viewport_width = -1;
+		output->viewport_height = -1;
+	}
 
-	// Only count a frame if we actually advanced. If a new output was added,
-	// we may have been called early to render the previous frame again.
-	if (advanced && anim->first_cycle) {
-		++anim->frame_count;
+	// Working in surface coordinates, the visible part of the image is the
+	// surface mapped back through the same transform we'd have scaled with.
+	struct oguri_resample_params params;
+	get_resample_params(output, source,
+			output->width, output->height, &params);
+
+	// The source rectangle must not stick out of the buffer, which rounding
+	// could otherwise make it do.
+	wl_fixed_t buffer_width = wl_fixed_from_int(params.source_width);
+	wl_fixed_t buffer_height = wl_fixed_from_int(params.source_height);
+	wl_fixed_t x = wl_fixed_from_double(fmax(0.0, -params.offset_x));
+	wl_fixed_t y = wl_fixed_from_double(fmax(0.0, -params.offset_y));
+	wl_fixed_t width = wl_fixed_from_double(output->width / params.scale_x);
+	wl_fixed_t height = wl_fixed_from_double(output->height / params.scale_y);
+	if (x + width > buffer_width) {
+		width = buffer_width - x;
+	}
+	if (y + height > buffer_height) {
+		height = buffer_height - y;
 	}
 
-	// It's important to set this _after_ we increment the frame_count for the
-	// final time.
-	bool last_frame = gdk_pixbuf_animation_iter_on_currently_loading_frame(
-			anim->frame_iter);
-	if (last_frame) {
-		anim->first_cycle = false;
+	wl_fixed_t viewport_source[4] = {x, y, width, height};
+	if (memcmp(viewport_source, output->viewport_source,
+				sizeof(viewport_source)) != 0) {
+		wp_viewport_set_source(output->viewport, x, y, width, height);
+		memcpy(output->viewport_source, viewport_source,
+				sizeof(viewport_source));
+	}
+	if (output->viewport_width != (int32_t)output->width ||
+			output->viewport_height != (int32_t)output->height) {
+		wp_viewport_set_destination(
+				output->viewport, output->width, output->height);
+		output->viewport_width = output->width;
+		output->viewport_height = output->height;
+	}
+	set_buffer_scale(output, 1);
+}
+
+// A cheap 64-bit hash of a frame's pixels, which narrows down the frames it
+// could be the same as. See identify_pixels for the rest.
+static uint64_t hash_pixbuf(const GdkPixbuf * pixbuf) {
+	const guint8 * pixels = gdk_pixbuf_read_pixels(pixbuf);
+	int width = gdk_pixbuf_get_width(pixbuf);
+	int height = gdk_pixbuf_get_height(pixbuf);
+	int channels = gdk_pixbuf_get_n_channels(pixbuf);
+	int stride = gdk_pixbuf_get_rowstride(pixbuf);
+	size_t row_length = (size_t)width * channels;
+
+	const uint64_t multiplier = 0xff51afd7ed558ccdULL;
+	uint64_t hash = 0x9e3779b97f4a7c15ULL ^ row_length ^ ((uint64_t)height << 32);
+	for (int y = 0; y < height; ++y) {
+		const guint8 * row = pixels + (size_t)y * stride;
+		size_t x = 0;
+		for (; x + sizeof(uint64_t) <= row_length; x += sizeof(uint64_t)) {
+			uint64_t word;
+			memcpy(&word, row + x, sizeof(word));
+			hash = (hash ^ word) * multiplier;
+			hash ^= hash >> 29;
+		}
+		for (; x < row_length; ++x) {
+			hash = (hash ^ row[x]) * multiplier;
+			hash ^= hash >> 29;
+		}
+	}
+	return hash;
+}
+
+// Adds the next frame to anim->frames, given which distinct frame it is and
+// whatever is known about its damage.
+static bool record_frame(struct oguri_animation * anim,
+		const struct oguri_frame_info * frame) {
+	if (anim->frames_length == anim->frames_allocated) {
+		unsigned int allocated = anim->frames_allocated ?
+			anim->frames_allocated * 2 : 16;
+		struct oguri_frame_info * frames = realloc(
+				anim->frames, allocated * sizeof(struct oguri_frame_info));
+		if (!frames) {
+			// This frame and the ones after it just won't be cached.
+			return false;
+		}
+		anim->frames = frames;
+		anim->frames_allocated = allocated;
+	}
+
+	struct oguri_frame_info * info = &anim->frames[anim->frames_length];
+	*info = *frame;
+	if (info->damage_known) {
+		++anim->damage_known_count;
+	}
+	if (info->unique_index == anim->unique_frame_count) {
+		++anim->unique_frame_count;
+	}
+	++anim->frames_length;
+	return true;
+}
+
+// Whether frame `index` comes straight after frame `before`.
+static bool frame_follows(
+		struct oguri_animation * anim, unsigned int before, unsigned int index) {
+	if (index > 0) {
+		return before == index - 1;
+	}
+	// Only once we've seen the last frame do we know what comes before the
+	// first.
+	return !anim->first_cycle && before == anim->frame_count - 1;
+}
+
+// Finds the bounding box of what changed between the previous frame, whose
+// pixels were kept by copy_pixels, and this one. This is done on the image
+// before it is scaled, so that it only has to happen once for all of the
+// outputs showing it.
+static void find_damage(const guint8 * previous,
+		GdkPixbuf * image, struct oguri_frame_info * info) {
+	const guint8 * pixels = gdk_pixbuf_read_pixels(image);
+	int width = gdk_pixbuf_get_width(image);
+	int height = gdk_pixbuf_get_height(image);
+	int channels = gdk_pixbuf_get_n_channels(image);
+	int stride = gdk_pixbuf_get_rowstride(image);
+	size_t row_length = (size_t)width * channels;
+
+	int left = width, right = 0, top = height, bottom = 0;
+	for (int y = 0; y < height; ++y) {
+		const guint8 * row = pixels + (size_t)y * stride;
+		const guint8 * previous_row = previous + y * row_length;
+		if (memcmp(row, previous_row, row_length) == 0) {
+			continue;
+		}
+
+		size_t first = 0, last = row_length - 1;
+		while (row[first] == previous_row[first]) {
+			++first;
+		}
+		while (row[last] == previous_row[last]) {
+			--last;
+		}
+
+		if ((int)(first / channels) < left) {
+			left = first / channels;
+		}
+		if ((int)(last / channels) + 1 > right) {
+			right = last / channels + 1;
+		}
+		if (y < top) {
+			top = y;
+		}
+		bottom = y + 1;
+	}
+
+	if (left < right) {
+		info->damage_x = left;
+		info->damage_y = top;
+		info->damage_width = right - left;
+		info->damage_height = bottom - top;
+	}
+	info->damage_known = true;
+}
+
+// Keeps a copy of the image's pixels for find_damage to compare the next one
+// against, allocating somewhere for them if need be.
+static bool copy_pixels(GdkPixbuf * image, guint8 ** copy) {
+	const guint8 * pixels = gdk_pixbuf_read_pixels(image);
+	int height = gdk_pixbuf_get_height(image);
+	int stride = gdk_pixbuf_get_rowstride(image);
+	size_t row_length = (size_t)gdk_pixbuf_get_width(image) *
+		gdk_pixbuf_get_n_channels(image);
+
+	if (!*copy) {
+		*copy = malloc(row_length * height);
+		if (!*copy) {
+			return false;  // Those frames will just be damaged in full.
+		}
+	}
+	for (int y = 0; y < height; ++y) {
+		memcpy(*copy + y * row_length,
+				pixels + (size_t)y * stride, row_length);
 	}
+	return true;
+}
 
+// Works out which distinct frame the image is. One with the same hash is only
+// taken to be the same once the pixels have been compared too, since two
+// different frames could hash the same. Returns its index in copies, which is
+// its unique_index, or -1 if it can't be told. A new frame is added to the
+// copies, but if there isn't room for its pixels, nothing later is ever taken
+// to be the same as it.
+static int identify_pixels(struct oguri_frame_copies * copies,
+		GdkPixbuf * image, uint64_t hash) {
+	const guint8 * pixels = gdk_pixbuf_read_pixels(image);
+	int height = gdk_pixbuf_get_height(image);
+	int stride = gdk_pixbuf_get_rowstride(image);
+	size_t row_length = (size_t)gdk_pixbuf_get_width(image) *
+		gdk_pixbuf_get_n_channels(image);
+
+	for (unsigned int i = 0; i < copies->length; ++i) {
+		const guint8 * copy = copies->copies[i].pixels;
+		if (copies->copies[i].hash != hash || !copy) {
+			continue;
+		}
+		int y = 0;
+		while (y < height && memcmp(copy + y * row_length,
+					pixels + (size_t)y * stride, row_length) == 0) {
+			++y;
+		}
+		if (y == height) {
+			return i;
+		}
+	}
+
+	if (copies->length == copies->allocated) {
+		unsigned int allocated = copies->allocated ?
+			copies->allocated * 2 : 16;
+		struct oguri_frame_copy * grown = realloc(copies->copies,
+				allocated * sizeof(struct oguri_frame_copy));
+		if (!grown) {
+			return -1;
+		}
+		copies->copies = grown;
+		copies->allocated = allocated;
+	}
+
+	struct oguri_frame_copy * copy = &copies->copies[copies->length++];
+	copy->hash = hash;
+	copy->pixels = NULL;
+	size_t size = row_length * height;
+	if (copies->size + size <= OGURI_MAX_FRAME_COPY_MEMORY &&
+			copy_pixels(image, &copy->pixels)) {
+		copies->size += size;
+	}
+	return copies->length - 1;
+}
+
+static void finish_frame_copies(struct oguri_frame_copies * copies) {
+	for (unsigned int i = 0; i < copies->length; ++i) {
+		free(copies->copies[i].pixels);
+	}
+	free(copies->copies);
+	*copies = (struct oguri_frame_copies) {0};
+}
+
+static void record_damage(struct oguri_animation * anim, GdkPixbuf * image) {
+	unsigned int index = anim->frame_index;
+	if (index >= anim->frames_length) {
+		return;
+	}
+	struct oguri_frame_info * info = &anim->frames[index];
+
+	if (!info->damage_known && !anim->first_cycle && anim->frame_count == 1) {
+		// A static image never changes.
+		info->damage_known = true;
+		++anim->damage_known_count;
+	}
+	else if (!info->damage_known && anim->previous_pixels &&
+			frame_follows(anim, anim->previous_index, index)) {
+		find_damage(anim->previous_pixels, image, info);
+		++anim->damage_known_count;
+	}
+
+	if (!anim->first_cycle && anim->damage_known_count >= anim->frames_length) {
+		free(anim->previous_pixels);
+		anim->previous_pixels = NULL;
+		return;
+	}
+
+	if (copy_pixels(image, &anim->previous_pixels)) {
+		anim->previous_index = index;
+	}
+}
+
+// Everything other than the frame itself which decides what ends up in the
+// output's buffer.
+static void get_output_params(
+		struct oguri_output * output,
+		struct oguri_animation * anim,
+		struct oguri_resample_params * params) {
+	if (oguri_output_uses_viewport(output)) {
+		// Scaled by the compositor, as set up by update_viewport.
+		get_resample_params(output, anim->source_surface,
+				output->width, output->height, params);
+	}
+	else {
+		get_resample_params(output, anim->source_surface,
+				output->buffer_width, output->buffer_height, params);
+	}
+}
+
+// Everything which decides what the output's buffers look like, so that it
+// can share them with other outputs that need the same.
+static void get_cache_key(
+		struct oguri_output * output,
+		const struct oguri_resample_params * params,
+		struct oguri_frame_cache_key * key) {
+	*key = (struct oguri_frame_cache_key) {
+		.width = output->buffer_width,
+		.height = output->buffer_height,
+		.compressed = output->config->compressed_cache,
+		.compositor_scaling = oguri_output_uses_viewport(output),
+	};
+	if (!key->compositor_scaling) {
+		key->params = *params;
+	}
+}
+
+// Whether the output is already showing something that looks exactly like
+// the current frame, in which case there's no need to commit anything.
+static bool output_is_current(
+		struct oguri_output * output,
+		struct oguri_animation * anim,
+		const struct oguri_resample_params * params) {
+	int shown = output->shown_frame;
+	if (shown < 0 ||
+			!oguri_resample_params_equal(&output->shown_params, params)) {
+		return false;
+	}
+	if ((unsigned int)shown == anim->frame_index) {
+		return true;
+	}
+	return (unsigned int)shown < anim->frames_length &&
+		anim->frame_index < anim->frames_length &&
+		anim->frames[shown].unique_index ==
+			anim->frames[anim->frame_index].unique_index;
+}
+
+// Damages whatever part of the output's buffer changed since the frame it
+// showed last, or all of it if that's not something we know.
+static void damage_output(
+		struct oguri_output * output,
+		struct oguri_animation * anim,
+		const struct oguri_resample_params * params) {
+	int shown = output->shown_frame;
+	bool same_params =
+		oguri_resample_params_equal(&output->shown_params, params);
+
+	output->shown_frame = anim->frame_index;
+	output->shown_params = *params;
+
+	struct oguri_frame_info * info = NULL;
+	if (anim->frame_index < anim->frames_length) {
+		info = &anim->frames[anim->frame_index];
+	}
+
+	// Every tile would need damaging, so it's not worth the bother there.
+	bool partial = info && info->damage_known && shown >= 0 && same_params &&
+		!params->repeat &&
+		frame_follows(anim, shown, anim->frame_index) &&
+		wl_surface_get_version(output->surface) >=
+			WL_SURFACE_DAMAGE_BUFFER_SINCE_VERSION;
+
+	if (!partial) {
+		wl_surface_damage(output->surface, 0, 0, output->width, output->height);
+		return;
+	}
+
+	if (!info->damage_width) {
+		return;  // Nothing changed at all.
+	}
+
+	if (oguri_output_uses_viewport(output)) {
+		// The buffer is the image, as is.
+		wl_surface_damage_buffer(output->surface,
+				info->damage_x, info->damage_y,
+				info->damage_width, info->damage_height);
+		return;
+	}
+
+	// Every scaled pixel depends on the image pixels within the filter's
+	// reach, which grows as the image shrinks. This errs on the side of
+	// damaging a bit too much.
+	double pad_x = 2 + 2 / params->scale_x;
+	double pad_y = 2 + 2 / params->scale_y;
+	double left = floor(
+			(info->damage_x - pad_x + params->offset_x) * params->scale_x);
+	double right = ceil((info->damage_x + info->damage_width + pad_x +
+				params->offset_x) * params->scale_x);
+	double top = floor(
+			(info->damage_y - pad_y + params->offset_y) * params->scale_y);
+	double bottom = ceil((info->damage_y + info->damage_height + pad_y +
+				params->offset_y) * params->scale_y);
+
+	left = fmax(left, 0);
+	top = fmax(top, 0);
+	right = fmin(right, output->buffer_width);
+	bottom = fmin(bottom, output->buffer_height);
+	if (left < right && top < bottom) {
+		wl_surface_damage_buffer(output->surface, left, top,
+				right - left, bottom - top);
+	}
+}
+
+void oguri_animation_print_stats(
+		struct oguri_animation * anim, FILE * stream) {
+	fprintf(stream, "animation %s: %u frames", anim->path, anim->frame_count);
+	if (anim->first_cycle && anim->probed_frame_count) {
+		fprintf(stream, " of %u", anim->probed_frame_count);
+	}
+	else if (anim->first_cycle) {
+		fprintf(stream, " so far");
+	}
+	fprintf(stream, ", %u unique", anim->unique_frame_count);
+	if (anim->prerendered) {
+		fprintf(stream, ", %u drawn in the background%s, %u missed",
+				anim->prerendered, anim->prerender ? " so far" : "",
+				anim->prerender_misses);
+	}
+	if (anim->ahead_drawn) {
+		fprintf(stream, ", %u drawn ahead, %u too late",
+				anim->ahead_drawn, anim->ahead_wasted);
+	}
+
+	if (anim->probed_frame_count) {
+		fprintf(stream, ", %.2f s per loop", anim->loop_duration / 1000.0);
+		if (anim->loop_count) {
+			fprintf(stream, ", plays %u times", anim->loop_count);
+		}
+	}
+	fprintf(stream, "\n");
+
+	if (anim->late_count) {
+		double mean = anim->late_total / 1e6 / anim->late_count;
+		double variance = anim->late_squares / anim->late_count - mean * mean;
+		fprintf(stream, "  committed %.2f ms after the deadline on average "
+				"(jitter %.2f ms, %.2f ms at worst) over %u frames\n", mean,
+				sqrt(variance > 0 ? variance : 0), anim->late_max / 1e6,
+				anim->late_count);
+	}
+	if (anim->frames_skipped) {
+		fprintf(stream, "  %u frames skipped to keep up\n",
+				anim->frames_skipped);
+	}
+}
+
+// Notes how long after it was due the current frame was committed, which is
+// about now.
+static void record_lateness(struct oguri_animation * anim) {
+	if (!anim->frame_deadline) {
+		return;
+	}
+	uint64_t now = oguri_get_time_ns();
+	uint64_t late = (now > anim->frame_deadline) ?
+		now - anim->frame_deadline : 0;
+	double milliseconds = late / 1e6;
+	anim->late_total += late;
+	anim->late_squares += milliseconds * milliseconds;
+	if (late > anim->late_max) {
+		anim->late_max = late;
+	}
+	++anim->late_count;
+}
+
+// How many unique frames there will be room for in the caches, or zero if
+// we can't start caching yet. Before the end of the first cycle, that's only
+// known if we probed the file, and then it's at most the number of frames.
+// The same goes for while the worker threads are still going, since they
+// might not have seen every frame yet.
+static unsigned int get_cache_length(struct oguri_animation * anim) {
+	if (!anim->first_cycle && !anim->prerender) {
+		return anim->unique_frame_count;
+	}
+	if (!anim->probed_frame_count) {
+		return 0;
+	}
+	return (anim->probed_frame_count > anim->unique_frame_count) ?
+		anim->probed_frame_count : anim->unique_frame_count;
+}
+
+static void frame_callback_done(void * data, struct wl_callback * callback,
+		uint32_t time __attribute__((unused))) {
+	struct oguri_output * output = data;
+	wl_callback_destroy(callback);
+	output->frame_callback = NULL;
+
+	// The compositor wants to see us again, so catch up to wherever the
+	// animation has got to in the meantime.
+	oguri_animation_refresh_output(output);
+}
+
+static const struct wl_callback_listener frame_callback_listener = {
+	.done = frame_callback_done,
+};
+
+// Works out which buffer will bring the output up to date with the current
+// frame, and claims it. Returns NULL if the output is better left alone for
+// now. If the frame still has to be drawn into the buffer, *draw is set.
+static struct oguri_buffer * prepare_output(
+		struct oguri_animation * anim,
+		struct oguri_output * output,
+		struct oguri_resample_params * params,
+		bool * draw) {
+	*draw = false;
+	if (!oguri_output_update_buffer_size(output)) {
+		return NULL;  // The output hasn't been configured yet.
+	}
+
+	struct oguri_frame_cache_key cache_key;
+	get_output_params(output, anim, params);
+	get_cache_key(output, params, &cache_key);
+	if (!oguri_frame_cache_attach(output, &cache_key)) {
+		return NULL;  // Out of memory, and quitting.
+	}
+	struct oguri_frame_cache * cache = output->cache;
+
+	// If what's on screen already looks like this frame (it's a repeat, or
+	// we were only woken up to make sure something was shown), leave the
+	// surface alone. The timeline carries on regardless.
+	if (output_is_current(output, anim, params)) {
+		output->shown_frame = anim->frame_index;
+		return NULL;
+	}
+
+	// Don't draw anything the compositor hasn't asked for yet. If it isn't
+	// asking because we're covered up, it may be a good while before it does.
+	// The frame callback will catch us up then. Something always gets shown
+	// straight away if we're not sure what's on screen, though, so changes
+	// to the output or its configuration aren't held up.
+	if (output->frame_callback && output->shown_frame >= 0) {
+		++output->frames_throttled;
+		return NULL;
+	}
+
+	// Nor while the compositor is behind on reading what we've already sent,
+	// since anything more would only queue up behind it. However many frames
+	// go by, the output is brought up to date once when it catches up.
+	if (output->oguri->flush_blocked) {
+		output->held = true;
+		++output->frames_held;
+		return NULL;
+	}
+
+	// A frame the worker threads haven't got to yet has missed its
+	// deadline. Rather than hold up the main thread drawing it here, the
+	// last one they had ready stays on screen until they catch up.
+	if (anim->prerender && anim->frame_index >= anim->prerendered) {
+		return NULL;
+	}
+
+	// Until we know how many frames there will be (or if the animation is
+	// even finite, technically), we don't cache anything. That's from the
+	// start if the file could be probed, or else after the first cycle. Each
+	// frame is then cached the first time it is drawn, for as long as the
+	// memory budget allows. Frames with identical contents share a single
+	// entry in the cache. Either way, another output sharing the cache may
+	// have just claimed a buffer for this frame.
+	unsigned int cache_length = get_cache_length(anim);
+	bool cacheable = cache_length && anim->frame_index < anim->frames_length;
+	int key = anim->frame_index < anim->frames_length ?
+		(int)anim->frames[anim->frame_index].unique_index : -1;
+
+	struct oguri_buffer * buffer = oguri_cached_frame(cache, key, cache_length);
+	if (!buffer && anim->ahead_ready && cache->ahead) {
+		// Drawn while we were waiting for this frame, before we knew which
+		// one it would turn out to be.
+		buffer = cache->ahead;
+		buffer->frame = key;
+	}
+	if (!buffer) {
+		if (cacheable) {
+			buffer = oguri_cache_frame(cache, key, cache_length);
+		}
+		if (!buffer) {
+			buffer = oguri_next_buffer(cache);
+		}
+		if (!buffer) {
+			// Every buffer is busy, so this frame is dropped. The next one
+			// to be released will bring us up to date.
+			return NULL;
+		}
+		buffer->frame = key;
+		*draw = true;
+	}
+
+	// Cached frames can be attached again while they're busy, since they're
+	// never drawn into. Scratch buffers have to wait for the release.
+	buffer->busy = true;
+	return buffer;
+}
+
+// The filter taps only depend on the geometry, so they are kept with the
+// cache, which is only ever used for the one geometry.
+static void prepare_resampler(struct oguri_frame_cache * cache) {
+	if (!cache->key.compositor_scaling && !cache->resampler) {
+		cache->resampler = oguri_resampler_create(&cache->key.params);
+	}
+}
+
+// Draws the image into each of the surfaces, which are for caches with the
+// given keys, using the given resamplers. Those which we scale ourselves all
+// share a single pass over the source surface, which the image is painted
+// into first, and are split between the workers if they're big enough. This
+// runs on the worker threads as well, with resamplers of their own, so it
+// only looks at what it's given.
+static void draw_image(GdkPixbuf * image, cairo_surface_t * source,
+		const struct oguri_frame_cache_key ** keys,
+		struct oguri_resampler ** resamplers,
+		cairo_surface_t ** surfaces,
+		int count,
+		struct oguri_workers * workers) {
+	if (count < 1) {
+		return;
+	}
+	struct oguri_resampler * scalers[count];
+	cairo_surface_t * targets[count];
+	int scaled = 0;
+	bool painted = false;
+	for (int i = 0; i < count; ++i) {
+		const struct oguri_frame_cache_key * key = keys[i];
+
+		if (key->compositor_scaling) {
+			// The compositor scales for us, so the frame goes straight into
+			// the buffer at its native size.
+			oguri_cairo_surface_paint_pixbuf(surfaces[i], image);
+			continue;
+		}
+
+		// Draw the frame into the source surface, at its native size, to be
+		// scaled into the buffers from there.
+		if (!painted) {
+			oguri_cairo_surface_paint_pixbuf(source, image);
+			painted = true;
+		}
+
+		if (resamplers[i]) {
+			scalers[scaled] = resamplers[i];
+			targets[scaled] = surfaces[i];
+			++scaled;
+		}
+		else {
+			scale_image_with_cairo(surfaces[i], &key->params, source);
+		}
+	}
+	oguri_resampler_run_many(scalers, targets, scaled, source, workers);
+}
+
+// Draws the image into buffers of the caches, on the main thread.
+static void draw_buffers(struct oguri_animation * anim, GdkPixbuf * image,
+		struct oguri_buffer ** buffers, int count) {
+	const struct oguri_frame_cache_key * keys[count];
+	struct oguri_resampler * resamplers[count];
+	cairo_surface_t * surfaces[count];
+	for (int i = 0; i < count; ++i) {
+		struct oguri_frame_cache * cache = buffers[i]->cache;
+		prepare_resampler(cache);
+		keys[i] = &cache->key;
+		resamplers[i] = cache->resampler;
+		surfaces[i] = buffers[i]->cairo_surface;
+	}
+	draw_image(image, anim->source_surface, keys, resamplers, surfaces, count,
+			anim->oguri->workers);
+}
+
+// Draws the current frame into each of the buffers.
+static void draw_frame(struct oguri_animation * anim,
+		struct oguri_buffer ** buffers, int count, GdkPixbuf ** image) {
+	if (count < 1) {
+		return;
+	}
+	if (!*image) {
+		*image = gdk_pixbuf_animation_iter_get_pixbuf(anim->frame_iter);
+	}
+	draw_buffers(anim, *image, buffers, count);
+
+	unsigned int cache_length = get_cache_length(anim);
+	if (cache_length && anim->frame_index < anim->frames_length) {
+		for (int i = 0; i < count; ++i) {
+			oguri_pack_frame(buffers[i]->cache, buffers[i]->frame,
+					cache_length, buffers[i]);
+		}
+	}
+}
+
+// Puts the buffer on screen, and asks to hear when the compositor would like
+// another.
+static void show_output(
+		struct oguri_animation * anim,
+		struct oguri_output * output,
+		struct oguri_buffer * buffer,
+		const struct oguri_resample_params * params) {
+	update_viewport(output, anim->source_surface);
+	wl_surface_attach(output->surface, buffer->backing, 0, 0);
+	damage_output(output, anim, params);
+
+	if (output->frame_callback) {
+		wl_callback_destroy(output->frame_callback);
+	}
+	output->frame_callback = wl_surface_frame(output->surface);
+	wl_callback_add_listener(
+			output->frame_callback, &frame_callback_listener, output);
+
+	wl_surface_commit(output->surface);
+}
+
+// Brings every output up to date with the animation's current frame, if
+// they're in a position to be shown one. All of the buffers are drawn before
+// any of them are shown, so that they can be drawn together. Returns how many
+// outputs were committed.
+static int render_outputs(
+		struct oguri_animation * anim, GdkPixbuf ** image) {
+	int output_count = wl_list_length(&anim->outputs);
+	if (output_count < 1) {
+		return 0;
+	}
+
+	struct oguri_buffer * buffers[output_count];
+	struct oguri_resample_params params[output_count];
+	struct oguri_buffer * drawn[output_count];
+	int drawn_count = 0;
+
+	int i = 0;
 	struct oguri_output * output;
 	wl_list_for_each(output, &anim->outputs, link) {
-		struct oguri_buffer * buffer = oguri_next_buffer(output);
-
-		if (output->cached_frames < anim->frame_count) {
-			if (!anim->first_cycle) {
-				// When we're past the first cycle, we want to have as many
-				// buffers as the animation has frames, because then we can
-				// keep each resized frame in a buffer instead of re-scaling it
-				// each time. However, we don't know which frame we started on,
-				// so just attempt to resize every frame until we've cached
-				// them all.
-				if (!oguri_allocate_buffers(output, anim->frame_count)) {
-					// TODO: This will freeze us at the current frame, probably
-					// should quit instead.
-					fprintf(stderr, "Unable to allocate %d frame buffers\n",
-							anim->frame_count);
-					return -1;
-				}
-			}
+		bool draw;
+		buffers[i] = prepare_output(anim, output, &params[i], &draw);
+		if (draw) {
+			drawn[drawn_count++] = buffers[i];
+		}
+		++i;
+	}
 
-			// Draw the frame into our source surface, at its native size.
-			oguri_cairo_surface_paint_pixbuf(anim->source_surface, image);
+	draw_frame(anim, drawn, drawn_count, image);
 
-			// Then scale it into the buffer.
-			scale_image_onto(buffer->cairo, anim->source_surface, output);
+	int shown = 0;
+	i = 0;
+	wl_list_for_each(output, &anim->outputs, link) {
+		if (buffers[i]) {
+			show_output(anim, output, buffers[i], &params[i]);
+			++shown;
+		}
+		++i;
+	}
+	return shown;
+}
+
+// How long the iterator's frame lasts in milliseconds, or negative if
+// forever. Everything that steps through the animation on its own clock has
+// to agree on this, or it would end up on a different frame. A zero delay
+// is stretched to 1, since it would never move the clock on.
+static int get_frame_delay(GdkPixbufAnimationIter * iter) {
+	int delay = gdk_pixbuf_animation_iter_get_delay_time(iter);
+	return (delay == 0) ? 1 : delay;
+}
+
+//
+// Drawing ahead
+//
+// Without the worker threads, the next frame is drawn on the main thread
+// while it waits for that frame to be due, so that when the timer goes off
+// all that's left is to attach the buffers. A second iterator, started at the
+// same time as the one we show frames from, is moved on to when the next
+// frame starts to see what it will be.
+//
+
+static void drop_ahead(struct oguri_animation * anim) {
+	struct oguri_frame_cache * cache;
+	wl_list_for_each(cache, &anim->caches, link) {
+		cache->ahead = NULL;
+	}
+	anim->ahead_valid = false;
+	anim->ahead_ready = false;
+	anim->ahead_hashed = false;
+}
+
+// The frame which comes after the current one. On the animation's own clock
+// that's known exactly, however late the current frame is running.
+static GdkPixbuf * get_ahead_image(struct oguri_animation * anim) {
+	uint64_t time = anim->frame_time + anim->frame_delay;
+	G_GNUC_BEGIN_IGNORE_DEPRECATIONS  // gdk-pixbuf still takes GTimeVals.
+	GTimeVal when = {
+		.tv_sec = time / 1000,
+		.tv_usec = (time % 1000) * 1000,
+	};
+	gdk_pixbuf_animation_iter_advance(anim->ahead_iter, &when);
+	G_GNUC_END_IGNORE_DEPRECATIONS
+	return gdk_pixbuf_animation_iter_get_pixbuf(anim->ahead_iter);
+}
+
+// Whether the cache is used by an output that's showing the current frame,
+// and so will want the next one when it's due. Outputs which are hidden, or
+// otherwise held back, will catch up on their own when they're able to.
+static bool cache_is_current(
+		struct oguri_animation * anim, struct oguri_frame_cache * cache) {
+	struct oguri_output * output;
+	wl_list_for_each(output, &anim->outputs, link) {
+		if (output->cache == cache &&
+				output->shown_frame == (int)anim->frame_index) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Gets the buffers ready for the frame after this one. Frames we know
+// already go straight into the caches, if they have room. Otherwise, each
+// cache keeps a scratch buffer aside for it, which prepare_output picks up
+// if the frame turns out to be what we expected.
+static void draw_ahead(struct oguri_animation * anim) {
+	if (!anim->ahead_iter || anim->ahead_valid || anim->prerender ||
+			!anim->deadline) {
+		return;
+	}
+	int cache_count = wl_list_length(&anim->caches);
+	if (cache_count < 1) {
+		return;
+	}
 
-			wl_surface_set_buffer_scale(output->surface, output->scale);
+	unsigned int next = anim->first_cycle ? anim->frame_index + 1 :
+		(anim->frame_index + 1) % anim->frame_count;
+	unsigned int cache_length = get_cache_length(anim);
+	bool cacheable = cache_length && next < anim->frames_length;
+	int key = (next < anim->frames_length) ?
+		(int)anim->frames[next].unique_index : -1;
 
-			if (!anim->first_cycle) {
-				// We count the number of frames we've cached to know when
-				// we've cached them all, even if we didn't start at the first
-				// frame of the animation. On the first cycle, however, we
-				// don't want to cache because we don't know how many there
-				// will be (or if the animation is even finite, technically).
-				++output->cached_frames;
+	struct oguri_buffer * buffers[cache_count];
+	int count = 0;
+	bool waiting = false;
+	struct oguri_frame_cache * cache;
+	wl_list_for_each(cache, &anim->caches, link) {
+		if (!cache_is_current(anim, cache)) {
+			continue;
+		}
+
+		// A compressed frame is expanded into the ring here and now, which
+		// is just as much work saved for later.
+		struct oguri_buffer * buffer =
+			oguri_cached_frame(cache, key, cache_length);
+		if (!buffer) {
+			if (cacheable) {
+				buffer = oguri_cache_frame(cache, key, cache_length);
+			}
+			if (!buffer) {
+				buffer = oguri_next_buffer(cache);
+			}
+			if (!buffer) {
+				continue;
 			}
+			buffers[count++] = buffer;
 		}
+		cache->ahead = buffer;
+		waiting = true;
+	}
+	if (!waiting) {
+		return;
+	}
+	anim->ahead_valid = true;
+	anim->ahead_frame = next;
+	if (count < 1) {
+		return;
+	}
 
-		// TODO: This should mark the buffer as busy, but we're not actually
-		// checking for that anyway.
-		wl_surface_attach(output->surface, buffer->backing, 0, 0);
-		wl_surface_damage(output->surface, 0, 0, output->width, output->height);
-		wl_surface_commit(output->surface);
+	GdkPixbuf * image = get_ahead_image(anim);
+	draw_buffers(anim, image, buffers, count);
+
+	for (int i = 0; i < count; ++i) {
+		buffers[i]->frame = key;
+		if (cacheable) {
+			oguri_pack_frame(buffers[i]->cache, key, cache_length, buffers[i]);
+		}
 	}
 
-	return delay;
+	// The first time around, it can be told apart from the others now too.
+	if (next == anim->frames_length) {
+		anim->ahead_hash = hash_pixbuf(image);
+		anim->ahead_hashed = true;
+	}
+	++anim->ahead_drawn;
 }
 
-bool oguri_animation_schedule_frame(
-		struct oguri_animation * anim, unsigned int delay) {
-	if (delay > 0) {
-		return set_timer_milliseconds(anim->timerfd, (unsigned int)delay);
+// Drawing frames in the background. The worker threads can't touch the
+// animation itself, so the jobs play through a copy of the image of their
+// own, in step with ours: each job is the next frame along. It draws the
+// frame for every cache which wants it, and works out everything about it
+// which record_frame and record_damage would have. Nor can they touch the
+// caches, which may be resized, flushed or destroyed while a job runs, so
+// each job draws with resamplers and into surfaces of its own. What it drew
+// is handed over to whichever caches still want it once it's back on the
+// main thread. Only one job per animation is in flight at a time, so the
+// jobs need no locking of their own, and the main thread never waits on one.
+struct oguri_prerender_target {
+	struct oguri_frame_cache_key key;
+	bool wanted;  // Some cache wants the frame drawn like this.
+
+	// Made by the job when it first needs them, and kept for the next frame.
+	struct oguri_resampler * resampler;
+	cairo_surface_t * surface;
+
+	struct oguri_rle_frame * packed;  // What was drawn, for compressed caches.
+};
+
+struct oguri_prerender {
+	struct oguri_job job;
+	struct oguri_animation * anim;  // NULL if it went away mid-job.
+	struct oguri_workers * workers;  // To share big frames with.
+	bool busy;  // Submitted, and not done yet.
+
+	// Only the worker running the job touches these.
+	char * path;
+	GdkPixbufAnimation * image;
+	GdkPixbufAnimationIter * iter;
+	unsigned int time;  // Milliseconds into the animation.
+	unsigned int position;  // How many frames it has seen.
+	cairo_surface_t * source_surface;
+	guint8 * previous_pixels;
+	struct oguri_frame_copies copies;  // The distinct frames seen.
+
+	// What the job is to do.
+	unsigned int frame;
+	unsigned int frame_count;  // As probed
+	unsigned int unique_index;  // What the frame will be, if it's new.
+	struct oguri_prerender_target * targets;  // Left alone while busy.
+	int target_count;
+	int targets_allocated;
+
+	// What came of it.
+	struct oguri_frame_info info;
+	bool failed;
+	bool repeat;  // Looks like an earlier frame, so nothing was drawn.
+	bool last;
+};
+
+// Moves the job's own copy of the image on to the next frame. gdk-pixbuf
+// picks the frame by the time, so it's handed the time each frame starts at
+// and never skips one.
+static GdkPixbuf * prerender_next_image(struct oguri_prerender * pre) {
+	G_GNUC_BEGIN_IGNORE_DEPRECATIONS  // gdk-pixbuf still takes GTimeVals.
+	if (!pre->image) {
+		GTimeVal start = {0};
+		pre->image = gdk_pixbuf_animation_new_from_file(pre->path, NULL);
+		if (!pre->image) {
+			return NULL;
+		}
+		pre->iter = gdk_pixbuf_animation_get_iter(pre->image, &start);
 	}
 	else {
-		return true;
+		int delay = get_frame_delay(pre->iter);
+		if (delay < 0) {
+			return NULL;  // It's over already.
+		}
+		pre->time += delay;
+		GTimeVal time = {
+			.tv_sec = pre->time / 1000,
+			.tv_usec = (pre->time % 1000) * 1000,
+		};
+		gdk_pixbuf_animation_iter_advance(pre->iter, &time);
 	}
+	G_GNUC_END_IGNORE_DEPRECATIONS
+	return gdk_pixbuf_animation_iter_get_pixbuf(pre->iter);
 }
 
-struct oguri_animation * oguri_animation_create(
-		struct oguri_state * oguri, char * image_path) {
-	int event_index = -1;
-	for (size_t i = OGURI_FIRST_ANIM_EVENT; i < OGURI_EVENT_COUNT; ++i) {
-		if (oguri->events[i].fd == -1) {
-			event_index = i;
-			break;
+// Draws the frame for the targets which want it. What's drawn for
+// compressed caches is packed here too, so that's off the main thread as
+// well.
+static void prerender_draw(struct oguri_prerender * pre, GdkPixbuf * image) {
+	int count = pre->target_count;
+	if (count < 1) {
+		return;
+	}
+	const struct oguri_frame_cache_key * keys[count];
+	struct oguri_resampler * resamplers[count];
+	cairo_surface_t * surfaces[count];
+	struct oguri_prerender_target * targets[count];
+	int drawn = 0;
+	for (int i = 0; i < count; ++i) {
+		struct oguri_prerender_target * target = &pre->targets[i];
+		if (!target->wanted) {
+			continue;
+		}
+		if (!target->key.compositor_scaling && !target->resampler) {
+			target->resampler = oguri_resampler_create(&target->key.params);
+		}
+		if (!target->surface) {
+			target->surface = cairo_image_surface_create(CAIRO_FMT,
+					target->key.width, target->key.height);
+		}
+		if (cairo_surface_status(target->surface) != CAIRO_STATUS_SUCCESS) {
+			cairo_surface_destroy(target->surface);
+			target->surface = NULL;
+			target->wanted = false;  // Not drawn, so it won't be cached.
+			continue;
+		}
+		keys[drawn] = &target->key;
+		resamplers[drawn] = target->resampler;
+		surfaces[drawn] = target->surface;
+		targets[drawn] = target;
+		++drawn;
+	}
+
+	draw_image(image, pre->source_surface, keys, resamplers, surfaces, drawn,
+			pre->workers);
+
+	for (int i = 0; i < drawn; ++i) {
+		if (targets[i]->key.compressed) {
+			cairo_surface_flush(surfaces[i]);
+			targets[i]->packed = oguri_rle_compress(
+					cairo_image_surface_get_data(surfaces[i]),
+					cairo_image_surface_get_width(surfaces[i]),
+					cairo_image_surface_get_height(surfaces[i]),
+					cairo_image_surface_get_stride(surfaces[i]));
+		}
+	}
+}
+
+// Runs on a worker thread.
+static void prerender_run(struct oguri_job * job) {
+	struct oguri_prerender * pre = wl_container_of(job, pre, job);
+	pre->failed = true;
+	pre->repeat = false;
+	pre->last = false;
+
+	if (pre->position != pre->frame) {
+		return;  // Out of step with the animation somehow.
+	}
+	GdkPixbuf * image = prerender_next_image(pre);
+	if (!image) {
+		return;
+	}
+	++pre->position;
+
+	if (!pre->source_surface) {
+		pre->source_surface = cairo_image_surface_create(
+				(gdk_pixbuf_get_n_channels(image) == 3) ?
+					CAIRO_FORMAT_RGB24 : CAIRO_FORMAT_ARGB32,
+				gdk_pixbuf_animation_get_width(pre->image),
+				gdk_pixbuf_animation_get_height(pre->image));
+	}
+
+	pre->failed = false;
+
+	// If this is the last frame, the first is yet to come after it, and
+	// that's up to record_damage.
+	pre->last = pre->position >= pre->frame_count ||
+		gdk_pixbuf_animation_iter_on_currently_loading_frame(pre->iter);
+	pre->info = (struct oguri_frame_info) {0};
+	if (pre->previous_pixels) {
+		find_damage(pre->previous_pixels, image, &pre->info);
+	}
+	if (pre->last || !copy_pixels(image, &pre->previous_pixels)) {
+		free(pre->previous_pixels);
+		pre->previous_pixels = NULL;
+	}
+
+	int unique_index = identify_pixels(
+			&pre->copies, image, hash_pixbuf(image));
+	if (unique_index < 0) {
+		pre->failed = true;
+		return;
+	}
+	pre->info.unique_index = unique_index;
+	pre->repeat = (unsigned int)unique_index != pre->unique_index;
+
+	if (!pre->repeat) {
+		prerender_draw(pre, image);
+	}
+}
+
+static struct oguri_frame_cache * find_cache(struct oguri_animation * anim,
+		const struct oguri_frame_cache_key * key) {
+	struct oguri_frame_cache * cache;
+	wl_list_for_each(cache, &anim->caches, link) {
+		if (oguri_frame_cache_key_equal(&cache->key, key)) {
+			return cache;
+		}
+	}
+	return NULL;
+}
+
+static void copy_surface(cairo_surface_t * from, cairo_surface_t * to) {
+	cairo_surface_flush(from);
+	cairo_surface_flush(to);
+	const unsigned char * source = cairo_image_surface_get_data(from);
+	int source_stride = cairo_image_surface_get_stride(from);
+	unsigned char * target = cairo_image_surface_get_data(to);
+	int target_stride = cairo_image_surface_get_stride(to);
+	int height = cairo_image_surface_get_height(to);
+	size_t row_length = (size_t)cairo_image_surface_get_width(to) * 4;
+	for (int y = 0; y < height; ++y) {
+		memcpy(target + (size_t)y * target_stride,
+				source + (size_t)y * source_stride, row_length);
+	}
+	cairo_surface_mark_dirty(to);
+}
+
+// Hands what the job drew over to the caches. They may have come and gone
+// since it was submitted, so they're looked up again by their keys, and
+// anything no cache wants any more is thrown away.
+static void finish_prerender(
+		struct oguri_animation * anim, struct oguri_prerender * pre) {
+	unsigned int cache_length = get_cache_length(anim);
+	for (int i = 0; i < pre->target_count; ++i) {
+		struct oguri_prerender_target * target = &pre->targets[i];
+		struct oguri_frame_cache * cache = find_cache(anim, &target->key);
+		struct oguri_buffer * buffer;
+		if (target->wanted && cache && oguri_reserve_frame(cache,
+					pre->unique_index, cache_length, &buffer)) {
+			if (buffer) {
+				copy_surface(target->surface, buffer->cairo_surface);
+				buffer->frame = pre->unique_index;
+			}
+			else {
+				oguri_store_packed_frame(cache, pre->unique_index,
+						target->packed, (size_t)cairo_format_stride_for_width(
+							CAIRO_FMT, target->key.width) * target->key.height);
+				target->packed = NULL;
+			}
+		}
+		free(target->packed);
+		target->packed = NULL;
+	}
+}
+
+static void prerender_target_finish(struct oguri_prerender_target * target) {
+	oguri_resampler_destroy(target->resampler);
+	if (target->surface) {
+		cairo_surface_destroy(target->surface);
+	}
+	free(target->packed);
+}
+
+static void prerender_destroy(struct oguri_prerender * pre) {
+	for (int i = 0; i < pre->target_count; ++i) {
+		prerender_target_finish(&pre->targets[i]);
+	}
+	free(pre->targets);
+	finish_frame_copies(&pre->copies);
+	free(pre->previous_pixels);
+	if (pre->source_surface) {
+		cairo_surface_destroy(pre->source_surface);
+	}
+	if (pre->iter) {
+		g_object_unref(pre->iter);
+	}
+	if (pre->image) {
+		g_object_unref(pre->image);
+	}
+	free(pre->path);
+	free(pre);
+}
+
+// The worker threads have seen the whole animation, or can't go on. Any
+// frames they didn't get to are drawn as they come up, as they would have
+// been without them.
+static void stop_prerender(struct oguri_animation * anim) {
+	struct oguri_prerender * pre = anim->prerender;
+	anim->prerender = NULL;
+
+	// If the animation has to go on identifying frames itself, it needs the
+	// ones seen so far to compare against.
+	if (anim->first_cycle && !pre->last) {
+		finish_frame_copies(&anim->copies);
+		anim->copies = pre->copies;
+		pre->copies = (struct oguri_frame_copies) {0};
+	}
+	prerender_destroy(pre);
+}
+
+// Hands the next frame to the worker threads, unless they're busy with one.
+static void prerender_next_frame(struct oguri_animation * anim) {
+	struct oguri_prerender * pre = anim->prerender;
+	if (!pre || pre->busy || wl_list_empty(&anim->caches)) {
+		return;
+	}
+
+	// Each cache gets a target, keeping the resampler and surface of the one
+	// it had for the last frame if there was one.
+	int cache_count = wl_list_length(&anim->caches);
+	if (pre->target_count + cache_count > pre->targets_allocated) {
+		int allocated = pre->target_count + cache_count;
+		struct oguri_prerender_target * targets = realloc(pre->targets,
+				allocated * sizeof(struct oguri_prerender_target));
+		if (!targets) {
+			return;  // Maybe next time.
+		}
+		pre->targets = targets;
+		pre->targets_allocated = allocated;
+	}
+	for (int i = 0; i < pre->target_count; ++i) {
+		pre->targets[i].wanted = false;
+	}
+
+	unsigned int cache_length = get_cache_length(anim);
+	struct oguri_frame_cache * cache;
+	wl_list_for_each(cache, &anim->caches, link) {
+		if (!cache_length || cache->full) {
+			continue;
+		}
+		struct oguri_prerender_target * target = NULL;
+		for (int i = 0; i < pre->target_count && !target; ++i) {
+			if (oguri_frame_cache_key_equal(
+						&pre->targets[i].key, &cache->key)) {
+				target = &pre->targets[i];
+			}
+		}
+		if (!target) {
+			target = &pre->targets[pre->target_count++];
+			*target = (struct oguri_prerender_target) {
+				.key = cache->key,
+			};
+		}
+		target->wanted = true;
+	}
+
+	// Any no cache wants any more are let go of.
+	int kept = 0;
+	for (int i = 0; i < pre->target_count; ++i) {
+		if (pre->targets[i].wanted) {
+			pre->targets[kept++] = pre->targets[i];
+		}
+		else {
+			prerender_target_finish(&pre->targets[i]);
+		}
+	}
+	pre->target_count = kept;
+
+	pre->frame = anim->frames_length;
+	pre->unique_index = anim->unique_frame_count;
+	pre->busy = oguri_workers_submit(anim->oguri->workers, &pre->job);
+}
+
+// Back on the main thread once the job is done.
+static void prerender_done(struct oguri_job * job) {
+	struct oguri_prerender * pre = wl_container_of(job, pre, job);
+	struct oguri_animation * anim = pre->anim;
+	if (!anim) {
+		prerender_destroy(pre);
+		return;
+	}
+
+	pre->busy = false;
+
+	unsigned int frame = pre->frame;
+	bool stop = pre->failed || pre->last;
+	if (!pre->failed) {
+		if (frame == anim->frames_length && record_frame(anim, &pre->info)) {
+			anim->prerendered = frame + 1;
+			if (!pre->repeat) {
+				finish_prerender(anim, pre);
+			}
+		}
+		else {
+			stop = true;
+		}
+	}
+	if (stop) {
+		stop_prerender(anim);
+	}
+
+	// If the frame is already due, it missed its deadline, so show it now
+	// rather than wait for the next.
+	if (anim->frame_index == frame && anim->prerendered == frame + 1) {
+		GdkPixbuf * image = NULL;
+		if (render_outputs(anim, &image)) {
+			record_lateness(anim);
 		}
 	}
+	prerender_next_frame(anim);
+}
+
+// The job decodes the image again for itself. The iterators of one
+// GdkPixbufAnimation share its decoding state (the GIF loader composites
+// frames into the animation itself), so they can't be stepped on two threads
+// at once. That copy holds up to a full-size frame for each frame, and only
+// lasts for the first cycle, but it's still only made if it fits within
+// OGURI_MAX_PRERENDER_MEMORY and max-cache-memory. Otherwise the frames are
+// drawn ahead on the main thread instead.
+static struct oguri_prerender * prerender_create(
+		struct oguri_animation * anim) {
+	size_t copy_size = (size_t)anim->probed_frame_count * 4 *
+		gdk_pixbuf_animation_get_width(anim->image) *
+		gdk_pixbuf_animation_get_height(anim->image);
+	if (copy_size > OGURI_MAX_PRERENDER_MEMORY ||
+			copy_size > anim->oguri->max_cache_memory) {
+		return NULL;
+	}
 
-	if (event_index == -1) {
-		fprintf(stderr, "No event slots available, too many animations!\n");
+	struct oguri_prerender * pre = calloc(1, sizeof(struct oguri_prerender));
+	if (!pre) {
 		return NULL;
 	}
+	pre->path = strdup(anim->path);
+	if (!pre->path) {
+		free(pre);
+		return NULL;
+	}
+
+	pre->job.run = prerender_run;
+	pre->job.done = prerender_done;
+	pre->anim = anim;
+	pre->workers = anim->oguri->workers;
+	pre->frame_count = anim->probed_frame_count;
+	return pre;
+}
 
+void oguri_animation_refresh_output(struct oguri_output * output) {
+	struct oguri_animation * anim = output->anim;
+	if (!anim) {
+		return;
+	}
+
+	struct oguri_resample_params params;
+	bool draw;
+	struct oguri_buffer * buffer = prepare_output(anim, output, &params, &draw);
+	if (!buffer) {
+		return;
+	}
+
+	if (draw) {
+		GdkPixbuf * image = NULL;
+		draw_frame(anim, &buffer, 1, &image);
+	}
+	show_output(anim, output, buffer, &params);
+}
+
+//
+// Timing
+//
+// The animation keeps a clock of its own, and gdk-pixbuf is only ever asked
+// for the frame which starts at some exact time on it. Each deadline is the
+// one before plus the frame's delay, and the timer is armed for it as an
+// absolute time, so the time we take to get each frame out never adds up.
+// CLOCK_MONOTONIC stands still while the system is suspended, so after a
+// resume the animation simply carries on from where it was.
+//
+
+// Frames are identified on the first cycle, in order, as they come in. The
+// worker threads do that instead while they're drawing ahead.
+static void identify_frame(struct oguri_animation * anim, GdkPixbuf ** image) {
+	if (anim->frame_index != anim->frames_length || anim->prerender) {
+		return;
+	}
+	if (!*image) {
+		*image = gdk_pixbuf_animation_iter_get_pixbuf(anim->frame_iter);
+	}
+	bool hashed = anim->ahead_hashed && anim->ahead_frame == anim->frame_index;
+	uint64_t hash = hashed ? anim->ahead_hash : hash_pixbuf(*image);
+	int unique_index = identify_pixels(&anim->copies, *image, hash);
+	if (unique_index < 0) {
+		return;  // This frame and the ones after it just won't be cached.
+	}
+	struct oguri_frame_info info = {
+		.unique_index = unique_index,
+	};
+	record_frame(anim, &info);
+}
+
+static void check_first_cycle(struct oguri_animation * anim) {
+	// It's important to set this _after_ we increment the frame_count for the
+	// final time.
+	bool last_frame = gdk_pixbuf_animation_iter_on_currently_loading_frame(
+			anim->frame_iter);
+	if (last_frame) {
+		anim->first_cycle = false;
+		finish_frame_copies(&anim->copies);
+	}
+}
+
+// Moves on to the frame after the current one, at exactly the time it starts.
+static void step_frame(struct oguri_animation * anim) {
+	anim->frame_time += anim->frame_delay;
+	anim->frame_deadline = anim->deadline;
+	G_GNUC_BEGIN_IGNORE_DEPRECATIONS  // gdk-pixbuf still takes GTimeVals.
+	GTimeVal when = {
+		.tv_sec = anim->frame_time / 1000,
+		.tv_usec = (anim->frame_time % 1000) * 1000,
+	};
+	bool advanced = gdk_pixbuf_animation_iter_advance(anim->frame_iter, &when);
+	G_GNUC_END_IGNORE_DEPRECATIONS
+
+	anim->frame_delay = get_frame_delay(anim->frame_iter);
+	anim->deadline = (anim->frame_delay < 0) ? 0 :
+		anim->frame_deadline + anim->frame_delay * (uint64_t)1000000;
+
+	if (!advanced) {
+		return;
+	}
+	if (anim->first_cycle) {
+		++anim->frame_count;
+		anim->frame_index = anim->frame_count - 1;
+	}
+	else {
+		anim->frame_index = (anim->frame_index + 1) % anim->frame_count;
+		if (anim->frame_index == 0 && !anim->cycle_time) {
+			anim->cycle_time = anim->frame_time;
+		}
+	}
+}
+
+// Steps the animation on to the frame which is due now. Frames which were
+// missed are passed through rather than shown late, since they still have
+// to be identified on the first cycle, but none of them are drawn. If we've
+// fallen more than a whole loop behind, the whole loops are skipped without
+// even that, and if we can't, the animation is picked up from where it
+// stopped rather than raced through. Returns whether it moved at all.
+static bool catch_up(struct oguri_animation * anim, uint64_t now) {
+	unsigned int steps = 0;
+	while (anim->deadline && anim->deadline <= now) {
+		uint64_t behind = now - anim->deadline;
+		uint64_t loop = anim->cycle_time * 1000000;
+		if (loop && !anim->loop_count && behind >= loop) {
+			uint64_t loops = behind / loop;
+			anim->deadline += loops * loop;
+			anim->frame_time += loops * anim->cycle_time;
+			anim->frames_skipped += loops * anim->frame_count;
+		}
+		else if (behind > OGURI_MAX_CATCH_UP_MS * (uint64_t)1000000) {
+			anim->deadline = now;
+		}
+
+		step_frame(anim);
+		++steps;
+		if (anim->deadline && anim->deadline <= now) {
+			GdkPixbuf * image = NULL;
+			identify_frame(anim, &image);
+			check_first_cycle(anim);
+		}
+	}
+	if (steps > 1) {
+		anim->frames_skipped += steps - 1;
+	}
+	return steps > 0;
+}
+
+// Shows whichever frame is due at the given time, which may be a moment
+// from now if the timers are letting us off early to share a wakeup.
+int oguri_render_frame(struct oguri_animation * anim, uint64_t now) {
+	// We may also have been called early to draw the current frame again, if
+	// a new output was added, in which case there's nothing to catch up on.
+	bool advanced = catch_up(anim, now);
+	oguri_timer_set(anim->oguri->timers, &anim->timer, anim->deadline);
+
+	// Whatever was drawn ahead can only be used if this is the frame it was
+	// drawn for, which it won't be if we're running late.
+	if (advanced && anim->ahead_valid) {
+		anim->ahead_ready = anim->frame_index == anim->ahead_frame;
+		if (!anim->ahead_ready) {
+			++anim->ahead_wasted;
+		}
+	}
+
+	// The frame is only fetched when something needs to look at it, which
+	// may well be nothing while all of our outputs are hidden.
+	GdkPixbuf * image = NULL;
+	identify_frame(anim, &image);
+	check_first_cycle(anim);
+
+	if (!anim->prerender && (anim->damage_known_count < anim->frames_length ||
+			anim->previous_pixels)) {
+		if (!image) {
+			image = gdk_pixbuf_animation_iter_get_pixbuf(anim->frame_iter);
+		}
+		record_damage(anim, image);
+	}
+
+	if (advanced && anim->prerender &&
+			anim->frame_index >= anim->prerendered) {
+		++anim->prerender_misses;
+	}
+
+	int shown = render_outputs(anim, &image);
+	if (advanced && shown) {
+		record_lateness(anim);
+	}
+
+	if (advanced) {
+		drop_ahead(anim);
+	}
+	prerender_next_frame(anim);
+	draw_ahead(anim);
+	return anim->frame_delay;
+}
+
+// Wakes the animation up after delay milliseconds to bring its outputs up to
+// date, without moving the next frame's deadline.
+bool oguri_animation_schedule_frame(
+		struct oguri_animation * anim, unsigned int delay) {
+	uint64_t when = oguri_get_time_ns() + delay * (uint64_t)1000000;
+	if (anim->deadline && anim->deadline < when) {
+		when = anim->deadline;
+	}
+	return oguri_timer_set(anim->oguri->timers, &anim->timer, when);
+}
+
+static void handle_timer(struct oguri_timer * timer, uint64_t now) {
+	struct oguri_animation * anim = wl_container_of(timer, anim, timer);
+	oguri_render_frame(anim, now);
+}
+
+struct oguri_animation * oguri_animation_create(
+		struct oguri_state * oguri, char * image_path) {
 	GError * error = NULL;
 	GdkPixbufAnimation * image = gdk_pixbuf_animation_new_from_file(
 			image_path, &error);
@@ -233,11 +1667,20 @@ struct oguri_animation * oguri_animation_create(
 
 	struct oguri_animation * anim = calloc(1, sizeof(struct oguri_animation));
 	wl_list_init(&anim->outputs);
+	wl_list_init(&anim->caches);
 
 	anim->oguri = oguri;
 	anim->path = strdup(image_path);
 	anim->image = image;
-	anim->frame_iter = gdk_pixbuf_animation_get_iter(image, NULL);
+
+	// Both iterators start at zero on the animation's own clock, see catch_up.
+	G_GNUC_BEGIN_IGNORE_DEPRECATIONS  // gdk-pixbuf still takes GTimeVals.
+	GTimeVal start = {0};
+	anim->frame_iter = gdk_pixbuf_animation_get_iter(image, &start);
+	if (oguri->render_ahead) {
+		anim->ahead_iter = gdk_pixbuf_animation_get_iter(image, &start);
+	}
+	G_GNUC_END_IGNORE_DEPRECATIONS
 
 	// There's no way to directly ask for the number of frames in an animation,
 	// because gdk-pixbuf is designed to work with possibly streaming sources.
@@ -246,12 +1689,41 @@ struct oguri_animation * oguri_animation_create(
 	// flag, to count the frames ourselves. Once we know how many there are, we
 	// can start caching the scaled buffers instead of rescaling each time we
 	// draw. We have to track the total length so we don't allocate an infinite
-	// number of buffers.
+	// number of buffers. Keeping track of which frame we're on lets outputs
+	// which join partway through find their cached frames.
 	anim->first_cycle = true;
 
+	// For the formats we can read the frame table of ourselves, we know how
+	// many there are before we start, and can cache from the first frame on.
+	// gdk-pixbuf is still the authority on what's actually shown, so the
+	// count is only used to size things, and the first cycle still happens.
+	struct oguri_probe probe;
+	if (oguri_probe_image(image_path, &probe)) {
+		anim->probed_frame_count = probe.frame_count;
+		anim->loop_count = probe.loop_count;
+		for (unsigned int i = 0; i < probe.frame_count; ++i) {
+			anim->loop_duration += probe.delays[i];
+		}
+		oguri_probe_finish(&probe);
+
+		anim->frames = calloc(
+				anim->probed_frame_count, sizeof(struct oguri_frame_info));
+		if (anim->frames) {
+			anim->frames_allocated = anim->probed_frame_count;
+		}
+
+		// Knowing how many frames there are, the worker threads can draw
+		// them all into the caches ahead of time. Nothing much would be
+		// gained for a still image.
+		if (anim->probed_frame_count > 1 && oguri->workers) {
+			anim->prerender = prerender_create(anim);
+		}
+	}
+
 	// The first frame drawn does not advance, so we can't count it. Instead,
 	// just start at 1.
 	anim->frame_count = 1;
+	anim->frame_index = 0;
 
 	// We're going to make the wild assumption that every frame in the
 	// animation has the same number of channels.
@@ -265,13 +1737,14 @@ struct oguri_animation * oguri_animation_create(
 			gdk_pixbuf_animation_get_width(image),
 			gdk_pixbuf_animation_get_height(image));
 
-	anim->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	anim->timer.fire = handle_timer;
 
-	oguri->events[event_index] = (struct pollfd) {
-		.fd = anim->timerfd,
-		.events = POLLIN,
-	};
-	anim->event_index = event_index;
+	// The first frame starts now, though it's only drawn once the timer goes
+	// off, by which point there may be outputs to draw it on.
+	anim->frame_delay = get_frame_delay(anim->frame_iter);
+	anim->frame_deadline = oguri_get_time_ns();
+	anim->deadline = (anim->frame_delay < 0) ? 0 :
+		anim->frame_deadline + anim->frame_delay * (uint64_t)1000000;
 
 	if (!oguri_animation_schedule_frame(anim, 1)) {  // Show first frame ASAP.
 		fprintf(stderr, "Unable to schedule first timer\n");
@@ -284,21 +1757,38 @@ struct oguri_animation * oguri_animation_create(
 void oguri_animation_destroy(struct oguri_animation * anim) {
 	wl_list_remove(&anim->link);
 
-	// Disable the pollfd entry so that another animation can reuse it later.
-	close(anim->timerfd);
-	anim->oguri->events[anim->event_index] = (struct pollfd) {
-		.fd = -1,
-		.events = 0,  // Not strictly necessary, but eases debugging.
-	};
+	// A worker may still be drawing the next frame. Once it has finished,
+	// the job is left for its done callback to clean up.
+	if (anim->prerender && anim->prerender->busy) {
+		anim->prerender->anim = NULL;
+	}
+	else if (anim->prerender) {
+		prerender_destroy(anim->prerender);
+	}
+	anim->prerender = NULL;
+
+	oguri_timer_set(anim->oguri->timers, &anim->timer, 0);
 
 	cairo_surface_destroy(anim->source_surface);
+	free(anim->frames);
+	finish_frame_copies(&anim->copies);
+	free(anim->previous_pixels);
 	g_object_unref(anim->image);
 	g_object_unref(anim->frame_iter);
+	if (anim->ahead_iter) {
+		g_object_unref(anim->ahead_iter);
+	}
 	free(anim->path);
 
 	// Put all of the associated outputs back into the idle list, in case we
 	// want to reassign them to a new animation later. Destroying them doesn't
 	// happen until they are removed from the display, or we are told to exit.
+	// Their caches go with the last of them.
+	struct oguri_output * output;
+	wl_list_for_each(output, &anim->outputs, link) {
+		oguri_frame_cache_detach(output);
+		output->anim = NULL;
+	}
 	wl_list_insert_list(&anim->oguri->idle_outputs, &anim->outputs);
 
 	anim->oguri = NULL;
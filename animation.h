@@ -2,22 +2,67 @@
 #define OGURI_ANIMATION_H
 
 #include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <cairo.h>
 #include <wayland-client.h>
 
 #include "cairo-pixbuf.h"
 #include "config.h"
+#include "timers.h"
+
+// How far behind the animation may fall before it's picked up from where it
+// stopped, rather than played through to where it should be, when it can't
+// skip whole loops instead.
+#define OGURI_MAX_CATCH_UP_MS 1000
+
+// The most memory the worker threads' own decoded copy of an image may take,
+// see prerender_create.
+#define OGURI_MAX_PRERENDER_MEMORY (256 * 1024 * 1024)
+
+// The most memory the copies of distinct frames may take while frames are
+// being told apart, see identify_pixels.
+#define OGURI_MAX_FRAME_COPY_MEMORY (64 * 1024 * 1024)
 
 struct oguri_state;
+struct oguri_output;
+struct oguri_prerender;
+
+struct oguri_frame_info {
+	// Frames which look exactly the same have the same index here, which is
+	// what the frame caches are keyed on.
+	unsigned int unique_index;
+
+	// The part of the image which changed since the previous frame. Empty if
+	// nothing did, only valid once damage_known is set.
+	bool damage_known;
+	int damage_x;
+	int damage_y;
+	int damage_width;
+	int damage_height;
+};
+
+// A copy of each distinct frame seen so far, which a frame that hashes the
+// same as one of them is compared with before they're taken to be the same.
+struct oguri_frame_copy {
+	uint64_t hash;
+	guint8 * pixels;  // NULL if there wasn't room to keep them.
+};
+
+struct oguri_frame_copies {
+	struct oguri_frame_copy * copies;  // Indexed by unique_index.
+	unsigned int length;
+	unsigned int allocated;
+	size_t size;  // Of all of the pixels together.
+};
 
 struct oguri_animation {
 	struct oguri_state * oguri;
 	struct wl_list link;
 
-	// In order to update our timer for each frame, we keep a reference to the
-	// timerfd that we placed into oguri::events.
-	int timerfd;
-	int event_index;
+	// Goes off when the next frame is due, or sooner to redraw the current
+	// one. Set in oguri::timers.
+	struct oguri_timer timer;
 
 	char * path;
 	GdkPixbufAnimation * image;
@@ -26,15 +71,72 @@ struct oguri_animation {
 
 	bool first_cycle;
 	unsigned int frame_count;
+	unsigned int frame_index;  // Of the frame currently being shown.
+
+	// The animation's own clock. gdk-pixbuf is handed the time each frame
+	// starts at, counted from the start of the animation, rather than the
+	// wall clock, so it can never be knocked off a frame. See catch_up.
+	uint64_t frame_time;  // Milliseconds
+	int frame_delay;  // How long the current frame lasts, negative if forever.
+	uint64_t cycle_time;  // Length of a loop as played, once it's been seen.
+	unsigned int frames_skipped;  // Passed over to catch up.
+
+	// What the file says about itself, if it could be probed. Zero if not.
+	unsigned int probed_frame_count;
+	unsigned int loop_count;  // Zero if it loops forever.
+	unsigned int loop_duration;  // Milliseconds
+
+	// Filled in during the first cycle, indexed by frame.
+	struct oguri_frame_info * frames;
+	unsigned int frames_length;
+	unsigned int frames_allocated;
+	unsigned int unique_frame_count;
+	struct oguri_frame_copies copies;  // Only until every frame is known.
+
+	// A copy of the last frame we saw, which the next one is compared against
+	// to find its damage. Dropped once every frame's damage is known.
+	guint8 * previous_pixels;
+	unsigned int previous_index;
+	unsigned int damage_known_count;
+
+	// When the frame table could be probed, the worker threads draw the
+	// frames into the caches ahead of time, until they've seen all of them.
+	// Until then, only the first prerendered frames are ready to be shown.
+	struct oguri_prerender * prerender;  // NULL when they aren't.
+	unsigned int prerendered;
+	unsigned int prerender_misses;  // Frames which weren't ready in time.
+
+	// Otherwise, the next frame is drawn on the main thread while it waits,
+	// with an iterator of its own. See draw_ahead.
+	GdkPixbufAnimationIter * ahead_iter;  // NULL if render-ahead is off.
+	bool ahead_valid;  // Something was got ready for ahead_frame.
+	bool ahead_ready;  // And that's the frame now being shown.
+	unsigned int ahead_frame;
+	bool ahead_hashed;
+	uint64_t ahead_hash;
+	unsigned int ahead_drawn;
+	unsigned int ahead_wasted;  // Drawn for a frame that was skipped.
+
+	// When the next frame is due, and how long after that each frame was
+	// committed, which is what the two above are trying to keep down.
+	uint64_t deadline;  // CLOCK_MONOTONIC nanoseconds, 0 if there isn't one.
+	uint64_t frame_deadline;  // When the current frame was due.
+	uint64_t late_total;  // Nanoseconds
+	uint64_t late_max;
+	double late_squares;  // Milliseconds squared, for the jitter.
+	unsigned int late_count;
 
 	struct wl_list outputs;  // oguri_output::link
+	struct wl_list caches;  // oguri_frame_cache::link
 };
 
-int oguri_render_frame(struct oguri_animation * anim);
+int oguri_render_frame(struct oguri_animation * anim, uint64_t now);
+void oguri_animation_refresh_output(struct oguri_output * output);
 bool oguri_animation_schedule_frame(
 		struct oguri_animation * anim, unsigned int delay);
 struct oguri_animation * oguri_animation_create(
 		struct oguri_state * oguri, char * image_path);
 void oguri_animation_destroy(struct oguri_animation * anim);
+void oguri_animation_print_stats(struct oguri_animation * anim, FILE * stream);
 
 #endif
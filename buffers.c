@@ -1,9 +1,8 @@
 //
 // Shared memory buffers
 //
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE  // For memfd_create, fallocate, mremap and Linux madvise flags
 
-#include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdbool.h>
@@ -13,7 +12,9 @@
 #include <sys/mman.h>
 #include <unistd.h>
 #include "oguri.h"
+#include "animation.h"
 #include "buffers.h"
+#include "cache.h"
 
 static int pid_shm_open(const char * prefix, int oflag, mode_t mode) {
 	static const char format[] = "%s-%d";
@@ -23,137 +24,361 @@ static int pid_shm_open(const char * prefix, int oflag, mode_t mode) {
 	if (length < 0) {
 		return -1;
 	}
-	char * name = calloc(1, length);
-	length = snprintf(name, length, format, prefix, pid);
-	if (length < 0) {
+	char * name = calloc(1, length + 1);
+	if (!name) {
 		return -1;
 	}
+	snprintf(name, length + 1, format, prefix, pid);
 
 	int fd = shm_open(name, oflag, mode);
-	if (fd < 0) {
-		return -1;
+	if (fd >= 0) {
+		shm_unlink(name);
 	}
-
-	shm_unlink(name);
 	free(name);
 	return fd;
 }
 
+// Makes an empty file for a pool to live in. memfd is preferred since it
+// never has a name to collide with or clean up, and lets us promise the
+// compositor that the file won't shrink underneath it. Growing can't be
+// sealed, because the pool does that.
+static int create_shm_file(void) {
+#ifdef HAVE_MEMFD_CREATE
+	int fd = memfd_create("oguri-buffer", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd >= 0) {
+		fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL);
+		return fd;
+	}
+#endif
+
+	// O_EXCL shouldn't be necessary here, but I would rather have it fail if
+	// something weird happens.
+	return pid_shm_open("/oguri-buffer", O_RDWR | O_CREAT | O_EXCL, 0600);
+}
+
+// Gets a slot's memory ready to be written to, so that drawing the first
+// frame into it doesn't take a page fault for every 4 KiB.
+static void prefault_slot(struct oguri_shm_pool * pool, size_t offset) {
+#ifdef MADV_POPULATE_WRITE
+	if (madvise((unsigned char *)pool->data + offset, pool->slot_size,
+				MADV_POPULATE_WRITE) == 0) {
+		return;
+	}
+#endif
+	// Older kernels can at least allocate the pages up front, even if
+	// they'll still need mapping in.
+	fallocate(pool->fd, FALLOC_FL_KEEP_SIZE, offset, pool->slot_size);
+}
+
+static void buffer_free_slot(struct oguri_buffer * buffer);
+
 static void buffer_handle_release(
 		void *data,
 		struct wl_buffer *wl_buffer __attribute__((unused))) {
-	((struct oguri_buffer *) data)->busy = false;
+	struct oguri_buffer * buffer = data;
+	buffer->busy = false;
+
+	// Destroyed while the compositor was still reading it, and only now can
+	// the slot be used for something else.
+	if (!buffer->cache) {
+		buffer_free_slot(buffer);
+		return;
+	}
+
+	oguri_frame_cache_release_buffer(buffer->cache, buffer);
 }
 
 static const struct wl_buffer_listener buffer_listener = {
 	.release = buffer_handle_release,
 };
 
-struct oguri_buffer * oguri_allocate_buffer(struct oguri_output * output) {
-	uint32_t stride = cairo_format_stride_for_width(
+//
+// Pools
+//
+
+// All of a frame cache's buffers come out of one shm pool, which saves a lot
+// of syscalls and compositor-side imports when there are many cached frames.
+// Since the buffers are all the same size, the pool is just an array of
+// equal slots. It doubles in size when it runs out, and goes away again once
+// the last buffer in it does.
+//
+// A slot can't be reused, or handed back to the kernel, while the compositor
+// might still be reading the buffer in it. Busy buffers which are destroyed
+// are retired instead: the wl_buffer stays around until it's released, and
+// only then is its slot freed. If the cache goes away in the meantime, its
+// pool is orphaned, and lives on until the last of them is released.
+
+static void buffer_attach_surface(struct oguri_buffer * buffer) {
+	struct oguri_shm_pool * pool = buffer->pool;
+	buffer->data = (unsigned char *)pool->data + buffer->offset;
+	buffer->cairo_surface = cairo_image_surface_create_for_data(
+			buffer->data,
 			CAIRO_FMT,
-			output->width * output->scale);
-	size_t size = stride * output->height * output->scale;
-	if (size < 1) {
-		fprintf(stderr, "Tiny buffer\n");
+			pool->width,
+			pool->height,
+			pool->stride);
+}
+
+static void buffer_detach_surface(struct oguri_buffer * buffer) {
+	cairo_surface_destroy(buffer->cairo_surface);
+	buffer->cairo_surface = NULL;
+}
+
+static struct oguri_shm_pool * shm_pool_create(
+		struct oguri_frame_cache * cache, int32_t width, int32_t height) {
+	int32_t stride = cairo_format_stride_for_width(CAIRO_FMT, width);
+	size_t page_size = sysconf(_SC_PAGESIZE);
+
+	struct oguri_shm_pool * pool = calloc(1, sizeof(struct oguri_shm_pool));
+	if (!pool) {
 		return NULL;
 	}
+	pool->oguri = cache->anim->oguri;
+	pool->cache = cache;
+	wl_list_init(&pool->link);
+	wl_list_init(&pool->buffers);
+	wl_list_init(&pool->retired);
+	pool->width = width;
+	pool->height = height;
+	pool->stride = stride;
+
+	// Slots are page aligned, so each one can be handed back to the kernel
+	// on its own when it's freed.
+	pool->slot_size = ((size_t)stride * height + page_size - 1) &
+		~(page_size - 1);
 
-	// O_EXCL shouldn't be necessary here, but I would rather have it fail if
-	// something weird happens.
 	errno = 0;
-	int fd = pid_shm_open("/oguri-buffer", O_RDWR | O_CREAT | O_EXCL, 0600);
-	if (fd < 0) {
+	pool->fd = create_shm_file();
+	if (pool->fd < 0) {
 		fprintf(stderr, "Failed to create buffer backing memory: %s\n",
 				strerror(errno));
+		free(pool);
 		return NULL;
 	}
-	shm_unlink("/oguri-buffer");
 
+	cache->pool = pool;
+	return pool;
+}
+
+static void shm_pool_destroy(struct oguri_shm_pool * pool) {
+	if (pool->cache) {
+		pool->cache->pool = NULL;
+	}
+	wl_list_remove(&pool->link);
+	if (pool->backing) {
+		wl_shm_pool_destroy(pool->backing);
+	}
+	if (pool->data) {
+		munmap(pool->data, pool->size);
+	}
+	close(pool->fd);
+	free(pool->slot_used);
+	free(pool);
+}
+
+// Maps the pool's file at its new size. Moving the existing mapping keeps all
+// of its pages mapped, where mapping the file afresh would mean tearing down
+// the page tables of every cached frame (and faulting them back in if they
+// are read again). With a few gigabytes of frames, that takes long enough to
+// miss several frames of the animation.
+static void * shm_pool_remap(struct oguri_shm_pool * pool, size_t size) {
+#ifdef MREMAP_MAYMOVE
+	if (pool->data) {
+		void * data = mremap(pool->data, pool->size, size, MREMAP_MAYMOVE);
+		if (data != MAP_FAILED) {
+			return data;
+		}
+	}
+#endif
+
+	// The existing contents live on in the file, so mapping it again from
+	// scratch keeps them.
 	errno = 0;
-	if (ftruncate(fd, size) < 0) {
-		fprintf(stderr, "Failed to resize buffer memory: %s\n",
-				strerror(errno));
-		close(fd);
+	void * data = mmap(
+			NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, pool->fd, 0);
+	if (data == MAP_FAILED) {
+		fprintf(stderr, "Failed to map backing memory: %s\n", strerror(errno));
 		return NULL;
 	}
+	if (pool->data) {
+		munmap(pool->data, pool->size);
+	}
+	return data;
+}
+
+// Makes room for at least one more buffer. The mapping may move, in which
+// case every buffer in the pool is pointed at its new location.
+static bool shm_pool_grow(struct oguri_frame_cache * cache) {
+	struct oguri_shm_pool * pool = cache->pool;
+	unsigned int slot_count = pool->slot_count ? pool->slot_count * 2 : 2;
+	size_t size = pool->slot_size * slot_count;
+
+	bool * slot_used = realloc(pool->slot_used, slot_count * sizeof(bool));
+	if (!slot_used) {
+		return false;
+	}
+	memset(slot_used + pool->slot_count, 0,
+			(slot_count - pool->slot_count) * sizeof(bool));
+	pool->slot_used = slot_used;
 
 	errno = 0;
-	void * data = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (ftruncate(pool->fd, size) < 0) {
+		fprintf(stderr, "Failed to resize buffer memory: %s\n",
+				strerror(errno));
+		return false;
+	}
+
+	void * data = shm_pool_remap(pool, size);
 	if (!data) {
-		fprintf(stderr, "Failed to map backing memory: %s\n", strerror(errno));
-		close(fd);
+		return false;
+	}
+
+	// Frames are big, so huge pages save a lot of TLB misses when drawing.
+	// The kernel will only use them for shm if configured to, though.
+	madvise(data, size, MADV_HUGEPAGE);
+
+	if (data != pool->data) {
+		struct oguri_buffer * buffer;
+		wl_list_for_each(buffer, &pool->buffers, pool_link) {
+			buffer_detach_surface(buffer);
+		}
+		pool->data = data;
+		wl_list_for_each(buffer, &pool->buffers, pool_link) {
+			buffer_attach_surface(buffer);
+		}
+	}
+	pool->size = size;
+	pool->slot_count = slot_count;
+
+	if (pool->backing) {
+		wl_shm_pool_resize(pool->backing, size);
+	}
+	else {
+		pool->backing = wl_shm_create_pool(
+				cache->anim->oguri->shm, pool->fd, size);
+	}
+	return true;
+}
+
+struct oguri_buffer * oguri_allocate_buffer(struct oguri_frame_cache * cache) {
+	int32_t width = cache->key.width;
+	int32_t height = cache->key.height;
+	if (width < 1 || height < 1) {
+		fprintf(stderr, "Tiny buffer\n");
+		return NULL;
+	}
+
+	struct oguri_shm_pool * pool = cache->pool;
+	if (!pool && !(pool = shm_pool_create(cache, width, height))) {
+		return NULL;
+	}
+
+	unsigned int slot = 0;
+	while (slot < pool->slot_count && pool->slot_used[slot]) {
+		++slot;
+	}
+	if (slot == pool->slot_count && !shm_pool_grow(cache)) {
+		if (wl_list_empty(&pool->buffers) && wl_list_empty(&pool->retired)) {
+			shm_pool_destroy(pool);
+		}
 		return NULL;
 	}
 
 	struct oguri_buffer * buffer = calloc(1, sizeof(struct oguri_buffer));
+	if (!buffer) {
+		return NULL;
+	}
 	wl_list_init(&buffer->link);
+	wl_list_insert(&pool->buffers, &buffer->pool_link);
+	pool->slot_used[slot] = true;
+
+	buffer->pool = pool;
+	buffer->cache = cache;
+	buffer->frame = -1;
+	buffer->slot = slot;
+	buffer->offset = pool->slot_size * slot;
+	buffer->size = (size_t)pool->stride * height;
+	prefault_slot(pool, buffer->offset);
+	buffer_attach_surface(buffer);
 
-	struct wl_shm_pool * pool = wl_shm_create_pool(
-			output->oguri->shm, fd, size);
 	buffer->backing = wl_shm_pool_create_buffer(
-			pool, 0,
-			output->width * output->scale,
-			output->height * output->scale,
-			stride,
+			pool->backing,
+			buffer->offset,
+			width,
+			height,
+			pool->stride,
 			WL_SHM_FORMAT_ARGB8888);
 	wl_buffer_add_listener(buffer->backing, &buffer_listener, buffer);
 
-	wl_shm_pool_destroy(pool);
-	close(fd);
-
-	buffer->data = data;
-	buffer->size = size;
-	buffer->cairo_surface = cairo_image_surface_create_for_data(
-			data,
-			CAIRO_FMT,
-			output->width * output->scale,
-			output->height * output->scale,
-			stride);
-	buffer->cairo = cairo_create(buffer->cairo_surface);
-
-	wl_list_insert(output->buffer_ring.prev, &buffer->link);
+	cache->buffer_memory += buffer->size;
+	cache->anim->oguri->cache_memory += buffer->size;
 	return buffer;
 }
 
-bool oguri_allocate_buffers(struct oguri_output * output, unsigned int count) {
-	struct oguri_buffer * buffer;
+// Gives the buffer's slot back to the pool, once the compositor is done with
+// it.
+static void buffer_free_slot(struct oguri_buffer * buffer) {
+	struct oguri_shm_pool * pool = buffer->pool;
+	wl_list_remove(&buffer->pool_link);
+	wl_buffer_destroy(buffer->backing);
 
-	// If we have too many buffers, shrink the pool instead to recover memory
-	// and prevent getting the animation out of sync.
-	if (output->buffer_count >= count) {
-		for (; output->buffer_count > count; --output->buffer_count) {
-			buffer = wl_container_of(output->buffer_ring.prev, buffer, link);
-			oguri_buffer_destroy(buffer);
-		}
+	pool->slot_used[buffer->slot] = false;
+	if (wl_list_empty(&pool->buffers) && wl_list_empty(&pool->retired)) {
+		shm_pool_destroy(pool);
 	}
 	else {
-		for (; output->buffer_count < count; ++output->buffer_count) {
-			buffer = oguri_allocate_buffer(output);
-			if (!buffer) {
-				return false;
-			}
-		}
+		// The pool can't shrink, but the memory behind the slot can still be
+		// given back until something needs it again.
+		madvise((unsigned char *)pool->data + buffer->offset,
+				pool->slot_size, MADV_REMOVE);
 	}
-	return true;
-}
-
-struct oguri_buffer * oguri_next_buffer(struct oguri_output * output) {
-	struct oguri_buffer * current = wl_container_of(
-			output->buffer_ring.next, current, link);
-	wl_list_remove(&current->link);
-	wl_list_insert(output->buffer_ring.prev, &current->link);
-
-	return wl_container_of(output->buffer_ring.next, current, link);
+	free(buffer);
 }
 
 void oguri_buffer_destroy(struct oguri_buffer * buffer) {
+	struct oguri_frame_cache * cache = buffer->cache;
+
+	if (cache->ahead == buffer) {
+		cache->ahead = NULL;
+	}
 	wl_list_remove(&buffer->link);
 
-	cairo_destroy(buffer->cairo);
-	cairo_surface_destroy(buffer->cairo_surface);
-	wl_buffer_destroy(buffer->backing);
+	cache->buffer_memory -= buffer->size;
+	cache->anim->oguri->cache_memory -= buffer->size;
 
-	munmap(buffer->data, buffer->size);
-	free(buffer);
+	buffer_detach_surface(buffer);
+
+	if (buffer->busy) {
+		buffer->cache = NULL;
+		wl_list_remove(&buffer->pool_link);
+		wl_list_insert(&buffer->pool->retired, &buffer->pool_link);
+		return;
+	}
+	buffer_free_slot(buffer);
+}
+
+// Lets go of a cache's pool when the cache is destroyed. Normally that's
+// already happened along with its last buffer, but if some of them are
+// retired, the pool has to outlive the cache until they're released.
+void oguri_buffers_orphan_pool(struct oguri_frame_cache * cache) {
+	struct oguri_shm_pool * pool = cache->pool;
+	if (!pool) {
+		return;
+	}
+	pool->cache = NULL;
+	cache->pool = NULL;
+	wl_list_insert(&pool->oguri->orphaned_pools, &pool->link);
+}
+
+// Nothing more will be released once we disconnect, so at exit whatever is
+// left is destroyed regardless.
+void oguri_buffers_destroy_orphans(struct oguri_state * oguri) {
+	// Each pool removes itself from the list along with its last buffer.
+	while (!wl_list_empty(&oguri->orphaned_pools)) {
+		struct oguri_shm_pool * pool = wl_container_of(
+				oguri->orphaned_pools.next, pool, link);
+		struct oguri_buffer * buffer = wl_container_of(
+				pool->retired.next, buffer, pool_link);
+		buffer_free_slot(buffer);
+	}
 }
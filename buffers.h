@@ -6,24 +6,59 @@
 #include <cairo.h>
 #include <wayland-client.h>
 
-#include "output.h"
+#include "cache.h"
+
+struct oguri_state;
+
+struct oguri_shm_pool {
+	struct oguri_state * oguri;
+	struct oguri_frame_cache * cache;  // NULL once orphaned, see below.
+	struct wl_list link;  // oguri_state::orphaned_pools, when orphaned
+
+	int fd;
+	struct wl_shm_pool * backing;
+	void * data;
+	size_t size;
+
+	// Every buffer in the pool has the same dimensions, and a slot of its own.
+	int32_t width;
+	int32_t height;
+	int32_t stride;
+	size_t slot_size;
+	unsigned int slot_count;
+	bool * slot_used;
+
+	struct wl_list buffers;  // oguri_buffer::pool_link
+
+	// Buffers which have been destroyed while the compositor was still
+	// reading them. Their slots stay reserved until they're released.
+	struct wl_list retired;  // oguri_buffer::pool_link
+};
 
 struct oguri_buffer {
-	struct wl_list link;  // oguri_output::buffer_ring;
+	struct wl_list link;  // oguri_frame_cache::buffer_ring, unless cached
+	struct wl_list pool_link;  // oguri_shm_pool::buffers or retired
+	struct oguri_shm_pool * pool;
+	struct oguri_frame_cache * cache;  // NULL once retired.
+
+	// The unique_index of the frame drawn into the buffer, or -1.
+	int frame;
+
+	unsigned int slot;
+	size_t offset;
 
-	bool busy;
+	bool busy;  // Attached, and not yet released by the compositor.
 
 	struct wl_buffer * backing;
-	cairo_t * cairo;
 	cairo_surface_t * cairo_surface;
 
 	void * data;
 	size_t size;
 };
 
-struct oguri_buffer * oguri_allocate_buffer(struct oguri_output * output);
-bool oguri_allocate_buffers(struct oguri_output * output, unsigned int count);
-struct oguri_buffer * oguri_next_buffer(struct oguri_output * output);
+struct oguri_buffer * oguri_allocate_buffer(struct oguri_frame_cache * cache);
 void oguri_buffer_destroy(struct oguri_buffer * buffer);
+void oguri_buffers_orphan_pool(struct oguri_frame_cache * cache);
+void oguri_buffers_destroy_orphans(struct oguri_state * oguri);
 
 #endif
@@ -0,0 +1,532 @@
+//
+// Frame caches
+//
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "oguri.h"
+#include "animation.h"
+#include "buffers.h"
+#include "cache.h"
+#include "output.h"
+#include "rle.h"
+#include "timers.h"
+
+static void flush_frame_cache(struct oguri_frame_cache * cache);
+
+// Outputs with the same resolution, scale and configuration would otherwise
+// each draw and keep identical copies of every frame. Instead, the frame
+// cache (along with the scratch ring and resampler) belongs to the
+// animation, and outputs are pointed at one that matches their key. The
+// same wl_buffer is then attached to all of their surfaces, and it only
+// goes back into the ring once the compositor has released it everywhere.
+
+bool oguri_frame_cache_key_equal(
+		const struct oguri_frame_cache_key * a,
+		const struct oguri_frame_cache_key * b) {
+	return a->width == b->width && a->height == b->height &&
+		a->compressed == b->compressed &&
+		a->compositor_scaling == b->compositor_scaling &&
+		(a->compositor_scaling ||
+			oguri_resample_params_equal(&a->params, &b->params));
+}
+
+static void frame_cache_destroy(struct oguri_frame_cache * cache) {
+	wl_list_remove(&cache->link);
+
+	flush_frame_cache(cache);
+	struct oguri_buffer * buffer, * tmp;
+	wl_list_for_each_safe(buffer, tmp, &cache->buffer_ring, link) {
+		oguri_buffer_destroy(buffer);
+	}
+	oguri_buffers_orphan_pool(cache);
+	oguri_resampler_destroy(cache->resampler);
+	free(cache);
+}
+
+static struct oguri_frame_cache * frame_cache_create(
+		struct oguri_animation * anim,
+		const struct oguri_frame_cache_key * key) {
+	struct oguri_frame_cache * cache = calloc(
+			1, sizeof(struct oguri_frame_cache));
+	if (!cache) {
+		return NULL;
+	}
+	cache->anim = anim;
+	cache->key = *key;
+	wl_list_init(&cache->buffer_ring);
+	wl_list_insert(anim->caches.prev, &cache->link);
+
+	// The scratch ring has two buffers, so there's one to draw into while the
+	// compositor holds on to the other. Cached frames are allocated by the
+	// animation loop as they are drawn.
+	if (!oguri_allocate_buffers(cache, 2)) {
+		frame_cache_destroy(cache);
+		return NULL;
+	}
+	return cache;
+}
+
+// Makes sure the output is using the frame cache for the given key, finding
+// or creating one as needed, and letting go of any it had before.
+bool oguri_frame_cache_attach(struct oguri_output * output,
+		const struct oguri_frame_cache_key * key) {
+	if (output->cache &&
+			oguri_frame_cache_key_equal(&output->cache->key, key)) {
+		return true;
+	}
+
+	oguri_frame_cache_detach(output);
+	output->shown_frame = -1;
+
+	struct oguri_frame_cache * cache;
+	wl_list_for_each(cache, &output->anim->caches, link) {
+		if (oguri_frame_cache_key_equal(&cache->key, key)) {
+			++cache->users;
+			output->cache = cache;
+			return true;
+		}
+	}
+
+	cache = frame_cache_create(output->anim, key);
+	if (!cache) {
+		fprintf(stderr, "Could not allocate buffers!\n");
+		output->oguri->run = false;
+		return false;
+	}
+	cache->users = 1;
+	output->cache = cache;
+	return true;
+}
+
+void oguri_frame_cache_detach(struct oguri_output * output) {
+	struct oguri_frame_cache * cache = output->cache;
+	if (!cache) {
+		return;
+	}
+	output->cache = NULL;
+	if (--cache->users == 0) {
+		frame_cache_destroy(cache);
+	}
+}
+
+// A buffer has come back after the ring ran dry, so every output which had
+// to drop a frame for want of one can have another go.
+static void frame_cache_unstall(struct oguri_frame_cache * cache) {
+	if (!cache->buffer_stalled) {
+		return;
+	}
+	cache->buffer_stalled = false;
+
+	struct oguri_output * output;
+	wl_list_for_each(output, &cache->anim->outputs, link) {
+		if (output->cache == cache) {
+			oguri_animation_refresh_output(output);
+		}
+	}
+}
+
+// Called when the compositor releases one of the cache's buffers.
+void oguri_frame_cache_release_buffer(
+		struct oguri_frame_cache * cache, struct oguri_buffer * buffer) {
+	// A scratch buffer the ring was shrunk past while it was busy. Cached
+	// frames aren't in the ring, and their link is empty.
+	if (cache->buffer_count > cache->buffer_target &&
+			!wl_list_empty(&buffer->link)) {
+		oguri_buffer_destroy(buffer);
+		--cache->buffer_count;
+		return;
+	}
+
+	// If a frame was dropped for want of a buffer, this one can have it.
+	frame_cache_unstall(cache);
+}
+
+void oguri_frame_cache_print_stats(
+		struct oguri_frame_cache * cache, FILE * stream) {
+	fprintf(stream, "cache %ux%u for", cache->key.width, cache->key.height);
+	struct oguri_output * output;
+	wl_list_for_each(output, &cache->anim->outputs, link) {
+		if (output->cache == cache) {
+			fprintf(stream, " %s", output->name ? output->name : "(unnamed)");
+		}
+	}
+	fprintf(stream, ": ");
+
+	if (cache->length) {
+		fprintf(stream, "%u/%u frames cached%s, ", cache->cached_frames,
+				cache->length, cache->full ? " (full)" : "");
+	}
+	else {
+		fprintf(stream, "not caching, ");
+	}
+
+	fprintf(stream, "%u scratch buffers, %.1f MiB, "
+			"%u stalls for a free buffer\n", cache->buffer_count,
+			(cache->buffer_memory + cache->packed_memory) / (1024.0 * 1024.0),
+			cache->buffer_stalls);
+
+	if (cache->packed_memory) {
+		fprintf(stream, "  compressed %.1f MiB to %.1f MiB (%.1f:1)",
+				cache->packed_source_memory / (1024.0 * 1024.0),
+				cache->packed_memory / (1024.0 * 1024.0),
+				(double)cache->packed_source_memory / cache->packed_memory);
+		if (cache->expand_count) {
+			fprintf(stream, ", %.2f ms to expand a frame",
+					cache->expand_time / 1e6 / cache->expand_count);
+		}
+		fprintf(stream, "\n");
+	}
+}
+
+//
+// Scratch ring
+//
+
+bool oguri_allocate_buffers(
+		struct oguri_frame_cache * cache, unsigned int count) {
+	struct oguri_buffer * buffer, * tmp;
+	cache->buffer_target = count;
+
+	// If we have too many buffers, shrink the pool instead to recover memory
+	// and prevent getting the animation out of sync. The compositor may
+	// still be showing some of them, usually the one just committed. Those
+	// go once they're released, in oguri_frame_cache_release_buffer.
+	if (cache->buffer_count >= count) {
+		wl_list_for_each_safe(buffer, tmp, &cache->buffer_ring, link) {
+			if (cache->buffer_count == count) {
+				break;
+			}
+			if (!buffer->busy) {
+				oguri_buffer_destroy(buffer);
+				--cache->buffer_count;
+			}
+		}
+	}
+	else {
+		for (; cache->buffer_count < count; ++cache->buffer_count) {
+			buffer = oguri_allocate_buffer(cache);
+			if (!buffer) {
+				return false;
+			}
+			wl_list_insert(cache->buffer_ring.prev, &buffer->link);
+		}
+	}
+	return true;
+}
+
+// Finds a scratch buffer which the compositor isn't using, to draw into. The
+// ring is kept in order of use, so the one at the front is the one most
+// likely to have been released by now. If they're all busy, another is added
+// up to a limit, beyond which the frame has to be dropped.
+struct oguri_buffer * oguri_next_buffer(struct oguri_frame_cache * cache) {
+	struct oguri_buffer * buffer;
+	wl_list_for_each(buffer, &cache->buffer_ring, link) {
+		if (!buffer->busy && buffer != cache->ahead) {
+			wl_list_remove(&buffer->link);
+			wl_list_insert(cache->buffer_ring.prev, &buffer->link);
+			buffer->frame = -1;  // About to be drawn over.
+			return buffer;
+		}
+	}
+
+	// Already stuck waiting for a release, nothing's changed since.
+	if (cache->buffer_stalled) {
+		return NULL;
+	}
+
+	// The scratch ring is also let go once every frame is cached, so it
+	// might need to come back. That doesn't count as a stall.
+	if (cache->buffer_target) {
+		++cache->buffer_stalls;
+	}
+
+	unsigned int count = cache->buffer_count ? cache->buffer_count + 1 : 2;
+	if (count > OGURI_MAX_SCRATCH_BUFFERS ||
+			!oguri_allocate_buffers(cache, count)) {
+		cache->buffer_stalled = true;
+		return NULL;
+	}
+
+	return wl_container_of(cache->buffer_ring.prev, buffer, link);
+}
+
+//
+// Cached frames
+//
+
+// Once the animation's length is known, each frame cache keeps scaled frames
+// in buffers of their own so they don't have to be drawn again next time
+// around. The total is limited by max-cache-memory, which is shared by every
+// cache. When it runs out, the frames that made it in stay there and the rest
+// are drawn into the scratch ring as they come up. Evicting instead wouldn't
+// help: playback is cyclic, so the least recently used frame is always the
+// one that's about to be needed.
+//
+// With compressed-cache, frames are kept run-length encoded instead, and
+// expanded into the scratch ring whenever they are shown.
+
+static void drop_frame(struct oguri_frame_cache * cache, unsigned int frame) {
+	if (cache->frames[frame]) {
+		oguri_buffer_destroy(cache->frames[frame]);
+		cache->frames[frame] = NULL;
+		--cache->cached_frames;
+	}
+	if (cache->packed_frames[frame]) {
+		size_t size = oguri_rle_size(cache->packed_frames[frame]);
+		cache->packed_memory -= size;
+		cache->anim->oguri->cache_memory -= size;
+		free(cache->packed_frames[frame]);
+		cache->packed_frames[frame] = NULL;
+		--cache->cached_frames;
+	}
+}
+
+// Makes room for frame_count unique frames, keeping the ones already cached.
+// When the animation's length is known up front, caching starts on the first
+// cycle with room for every frame, and only shrinks at the end of it if some
+// turned out to be repeats.
+static bool prepare_frame_cache(
+		struct oguri_frame_cache * cache, unsigned int frame_count) {
+	if (cache->length == frame_count) {
+		return true;
+	}
+	if (frame_count == 0) {
+		flush_frame_cache(cache);
+		return false;
+	}
+
+	for (unsigned int i = frame_count; i < cache->length; ++i) {
+		drop_frame(cache, i);
+	}
+	if (frame_count < cache->length) {
+		cache->length = frame_count;
+	}
+
+	struct oguri_buffer ** frames = realloc(
+			cache->frames, frame_count * sizeof(struct oguri_buffer *));
+	if (!frames) {
+		return false;
+	}
+	cache->frames = frames;
+	struct oguri_rle_frame ** packed_frames = realloc(cache->packed_frames,
+			frame_count * sizeof(struct oguri_rle_frame *));
+	if (!packed_frames) {
+		return false;
+	}
+	cache->packed_frames = packed_frames;
+
+	for (unsigned int i = cache->length; i < frame_count; ++i) {
+		cache->frames[i] = NULL;
+		cache->packed_frames[i] = NULL;
+	}
+	cache->length = frame_count;
+
+	// If everything made it in on the first cycle, the scratch buffers won't
+	// be used again.
+	if (!cache->key.compressed && cache->cached_frames == frame_count) {
+		oguri_allocate_buffers(cache, 0);
+	}
+	return true;
+}
+
+static bool frame_cache_has_room(struct oguri_frame_cache * cache, size_t size) {
+	struct oguri_state * oguri = cache->anim->oguri;
+	if (oguri->cache_memory + size <= oguri->max_cache_memory) {
+		return true;
+	}
+
+	if (!cache->full) {
+		fprintf(stderr, "Frame cache is full, %u of %u frames of %s will be "
+				"re-scaled at %ux%u\n",
+				cache->length - cache->cached_frames, cache->length,
+				cache->anim->path, cache->key.width, cache->key.height);
+		cache->full = true;
+	}
+	return false;
+}
+
+// Finds a buffer which already holds the given frame, if there is one. That
+// might be because it's cached, or because another output sharing the cache
+// has just drawn it into the scratch ring. Compressed frames are expanded
+// into the ring. frame_count is the number of unique frames, or 0 if that
+// isn't known yet.
+struct oguri_buffer * oguri_cached_frame(
+		struct oguri_frame_cache * cache,
+		int frame,
+		unsigned int frame_count) {
+	if (frame < 0) {
+		return NULL;  // We don't know which frame this is.
+	}
+	if (frame_count) {
+		prepare_frame_cache(cache, frame_count);
+	}
+	// A cached buffer might still be waiting for a worker to draw into it.
+	if ((unsigned int)frame < cache->length && cache->frames[frame]) {
+		struct oguri_buffer * buffer = cache->frames[frame];
+		return (buffer->frame == frame) ? buffer : NULL;
+	}
+
+	// Scratch buffers can be attached again while they're busy, as long as
+	// nothing draws into them in the meantime.
+	struct oguri_buffer * buffer;
+	wl_list_for_each(buffer, &cache->buffer_ring, link) {
+		if (buffer->frame == frame) {
+			wl_list_remove(&buffer->link);
+			wl_list_insert(cache->buffer_ring.prev, &buffer->link);
+			return buffer;
+		}
+	}
+
+	if ((unsigned int)frame >= cache->length) {
+		return NULL;
+	}
+	struct oguri_rle_frame * packed = cache->packed_frames[frame];
+	if (!packed) {
+		return NULL;
+	}
+
+	buffer = oguri_next_buffer(cache);
+	if (!buffer) {
+		return NULL;
+	}
+
+	uint64_t start = oguri_get_time_ns();
+	cairo_surface_flush(buffer->cairo_surface);
+	oguri_rle_expand(packed,
+			cairo_image_surface_get_data(buffer->cairo_surface),
+			cairo_image_surface_get_stride(buffer->cairo_surface));
+	cairo_surface_mark_dirty(buffer->cairo_surface);
+	cache->expand_time += oguri_get_time_ns() - start;
+	++cache->expand_count;
+
+	buffer->frame = frame;
+	return buffer;
+}
+
+struct oguri_buffer * oguri_cache_frame(
+		struct oguri_frame_cache * cache,
+		unsigned int frame,
+		unsigned int frame_count) {
+	if (cache->key.compressed ||
+			!prepare_frame_cache(cache, frame_count) ||
+			frame >= frame_count || cache->frames[frame]) {
+		return NULL;
+	}
+
+	size_t size = cairo_format_stride_for_width(
+			CAIRO_FMT, cache->key.width) * cache->key.height;
+	if (!frame_cache_has_room(cache, size)) {
+		return NULL;
+	}
+
+	struct oguri_buffer * buffer = oguri_allocate_buffer(cache);
+	if (!buffer) {
+		// Not fatal, we can always keep using the scratch ring instead.
+		cache->full = true;
+		return NULL;
+	}
+
+	cache->frames[frame] = buffer;
+	++cache->cached_frames;
+
+	// Once everything is cached, the scratch buffers won't be used again.
+	if (cache->cached_frames == frame_count) {
+		oguri_allocate_buffers(cache, 0);
+	}
+	return buffer;
+}
+
+void oguri_pack_frame(
+		struct oguri_frame_cache * cache,
+		unsigned int frame,
+		unsigned int frame_count,
+		struct oguri_buffer * buffer) {
+	// Once we've run out of room there's no point compressing every frame
+	// just to throw it away again.
+	if (!cache->key.compressed || cache->full ||
+			!prepare_frame_cache(cache, frame_count) ||
+			frame >= frame_count || cache->packed_frames[frame]) {
+		return;
+	}
+
+	cairo_surface_flush(buffer->cairo_surface);
+	struct oguri_rle_frame * packed = oguri_rle_compress(
+			cairo_image_surface_get_data(buffer->cairo_surface),
+			cairo_image_surface_get_width(buffer->cairo_surface),
+			cairo_image_surface_get_height(buffer->cairo_surface),
+			cairo_image_surface_get_stride(buffer->cairo_surface));
+	oguri_store_packed_frame(cache, frame, packed, buffer->size);
+}
+
+// Takes ownership of a compressed frame, keeping it if there's room. NULL
+// means it couldn't be compressed, which isn't going to get any better.
+void oguri_store_packed_frame(
+		struct oguri_frame_cache * cache,
+		unsigned int frame,
+		struct oguri_rle_frame * packed,
+		size_t source_size) {
+	if (!packed) {
+		cache->full = true;
+		return;
+	}
+
+	size_t size = oguri_rle_size(packed);
+	if (frame >= cache->length || cache->packed_frames[frame] ||
+			!frame_cache_has_room(cache, size)) {
+		free(packed);
+		return;
+	}
+
+	cache->packed_frames[frame] = packed;
+	cache->packed_memory += size;
+	cache->packed_source_memory += source_size;
+	cache->anim->oguri->cache_memory += size;
+	++cache->cached_frames;
+}
+
+// Frames drawn by the worker threads are handed over to the caches once
+// they're done. This checks whether the cache still wants the frame, and for
+// uncompressed caches claims a buffer for it to be copied into. Compressed
+// frames are handed over with oguri_store_packed_frame instead.
+bool oguri_reserve_frame(
+		struct oguri_frame_cache * cache,
+		unsigned int frame,
+		unsigned int frame_count,
+		struct oguri_buffer ** buffer) {
+	*buffer = NULL;
+	if (!prepare_frame_cache(cache, frame_count) || frame >= frame_count) {
+		return false;
+	}
+
+	if (cache->key.compressed) {
+		return !cache->full && !cache->packed_frames[frame];
+	}
+	*buffer = oguri_cache_frame(cache, frame, frame_count);
+	return *buffer != NULL;
+}
+
+static void flush_frame_cache(struct oguri_frame_cache * cache) {
+	for (unsigned int i = 0; i < cache->length; ++i) {
+		if (cache->frames[i]) {
+			oguri_buffer_destroy(cache->frames[i]);
+		}
+		free(cache->packed_frames[i]);
+	}
+	free(cache->frames);
+	free(cache->packed_frames);
+	cache->anim->oguri->cache_memory -= cache->packed_memory;
+
+	cache->frames = NULL;
+	cache->packed_frames = NULL;
+	cache->length = 0;
+	cache->full = false;
+	cache->cached_frames = 0;
+
+	cache->packed_memory = 0;
+	cache->packed_source_memory = 0;
+	cache->expand_time = 0;
+	cache->expand_count = 0;
+}
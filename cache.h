@@ -0,0 +1,109 @@
+#ifndef OGURI_CACHE_H
+#define OGURI_CACHE_H
+
+// How many scratch buffers a frame cache may have while waiting for the
+// compositor to release them.
+#define OGURI_MAX_SCRATCH_BUFFERS 4
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <wayland-client.h>
+
+#include "resample.h"
+
+struct oguri_animation;
+struct oguri_output;
+struct oguri_buffer;
+struct oguri_rle_frame;
+struct oguri_resampler;
+struct oguri_shm_pool;
+
+// Everything other than the frame itself which decides what ends up in a
+// buffer. Outputs of the same animation which agree on all of it share one
+// frame cache, and are shown the very same buffers.
+struct oguri_frame_cache_key {
+	uint32_t width;
+	uint32_t height;
+	bool compressed;
+
+	// When the compositor is scaling, buffers hold the frame at its native
+	// size and params don't come into it.
+	bool compositor_scaling;
+	struct oguri_resample_params params;
+};
+
+struct oguri_frame_cache {
+	struct oguri_animation * anim;
+	struct wl_list link;  // oguri_animation::caches
+	unsigned int users;  // Outputs with this as their cache.
+
+	struct oguri_frame_cache_key key;
+	struct oguri_resampler * resampler;
+	struct oguri_shm_pool * pool;  // Where all of the buffers below live.
+	size_t buffer_memory;  // Everything in buffer_ring and frames.
+
+	// Scaled frames which are kept around, indexed by oguri_frame_info's
+	// unique_index. Each frame is in one or the other, depending on
+	// compressed-cache.
+	struct oguri_buffer ** frames;  // NULL where a frame isn't cached.
+	struct oguri_rle_frame ** packed_frames;
+	unsigned int length;
+	unsigned int cached_frames;
+	bool full;  // Ran out of max-cache-memory.
+
+	// Compressed cache statistics.
+	size_t packed_memory;
+	size_t packed_source_memory;  // What packed_frames would be uncompressed.
+	uint64_t expand_time;  // Nanoseconds
+	unsigned int expand_count;
+
+	// Scratch buffers for frames which aren't cached.
+	struct wl_list buffer_ring;  // oguri_buffer::link
+	struct oguri_buffer * ahead;  // Holds the next frame, see draw_ahead.
+	unsigned int buffer_count;
+	unsigned int buffer_target;  // Any more are let go once released.
+	bool buffer_stalled;  // Dropped a frame because they were all busy.
+	unsigned int buffer_stalls;
+};
+
+bool oguri_frame_cache_key_equal(
+		const struct oguri_frame_cache_key * a,
+		const struct oguri_frame_cache_key * b);
+bool oguri_frame_cache_attach(struct oguri_output * output,
+		const struct oguri_frame_cache_key * key);
+void oguri_frame_cache_detach(struct oguri_output * output);
+void oguri_frame_cache_release_buffer(
+		struct oguri_frame_cache * cache, struct oguri_buffer * buffer);
+void oguri_frame_cache_print_stats(
+		struct oguri_frame_cache * cache, FILE * stream);
+
+bool oguri_allocate_buffers(
+		struct oguri_frame_cache * cache, unsigned int count);
+struct oguri_buffer * oguri_next_buffer(struct oguri_frame_cache * cache);
+
+struct oguri_buffer * oguri_cached_frame(
+		struct oguri_frame_cache * cache,
+		int frame,
+		unsigned int frame_count);
+struct oguri_buffer * oguri_cache_frame(
+		struct oguri_frame_cache * cache,
+		unsigned int frame,
+		unsigned int frame_count);
+void oguri_pack_frame(
+		struct oguri_frame_cache * cache,
+		unsigned int frame,
+		unsigned int frame_count,
+		struct oguri_buffer * buffer);
+void oguri_store_packed_frame(
+		struct oguri_frame_cache * cache,
+		unsigned int frame,
+		struct oguri_rle_frame * packed,
+		size_t source_size);
+bool oguri_reserve_frame(
+		struct oguri_frame_cache * cache,
+		unsigned int frame,
+		unsigned int frame_count,
+		struct oguri_buffer ** buffer);
+
+#endif
@@ -1,9 +1,233 @@
 // This is cargo-culted from mako, which in turn took it from from sway. It's
 // modified to draw into an existing surface instead of creating one, and I
 // also de-macro'd the premultiplied alpha routine.
+//
+// Since this runs for every frame on every output until the scaled frames are
+// cached, the per-row conversions also have SSE2/SSSE3/AVX2 versions which are
+// picked at runtime. They must produce exactly the same bytes as the scalar
+// versions, which remain the fallback for everything else.
 
+#include <pthread.h>
 #include "cairo-pixbuf.h"
 
+#if (defined(__x86_64__) || defined(__i386__)) && \
+	(defined(__GNUC__) || defined(__clang__))
+#define OGURI_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+// Converts a single row of `width` pixels from gdk-pixbuf's byte order into
+// cairo's native-endian pixels.
+typedef void oguri_row_converter_t(
+		const guint8 * gp, unsigned char * cp, int width);
+
+static void swizzle_row_scalar(
+		const guint8 * gp, unsigned char * cp, int width) {
+	const guint8 * end = gp + (3 * width);
+	while (gp < end) {
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+		cp[0] = gp[2];
+		cp[1] = gp[1];
+		cp[2] = gp[0];
+		cp[3] = 0xff;
+#else
+		cp[0] = 0xff;
+		cp[1] = gp[0];
+		cp[2] = gp[1];
+		cp[3] = gp[2];
+#endif
+		gp += 3;
+		cp += 4;
+	}
+}
+
+/* premul-color = alpha/255 * color/255 * 255 = (alpha*color)/255
+ * (z/255) = z/256 * 256/255     = z/256 (1 + 1/255)
+ *         = z/256 + (z/256)/255 = (z + z/255)/256
+ *         # recurse once
+ *         = (z + (z + z/255)/256)/256
+ *         = (z + z/256 + z/256/255) / 256
+ *         # only use 16bit uint operations, loose some precision,
+ *         # result is floored.
+ *       ->  (z + z>>8)>>8
+ *         # add 0x80/255 = 0.5 to convert floor to round
+ *       =>  (z+0x80 + (z+0x80)>>8 ) >> 8
+ * ------
+ * tested as equal to lround(z/255.0) for uint z in [0..0xfe02]
+ */
+static void premultiply_row_scalar(
+		const guint8 * gp, unsigned char * cp, int width) {
+	const guint8 * end = gp + (4 * width);
+	guint z1, z2, z3;
+	while (gp < end) {
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+		z1 = gp[2] * gp[3] + 0x80;
+		z2 = gp[1] * gp[3] + 0x80;
+		z3 = gp[0] * gp[3] + 0x80;
+
+		cp[0] = (z1 + (z1 >> 8)) >> 8;
+		cp[1] = (z2 + (z2 >> 8)) >> 8;
+		cp[2] = (z3 + (z3 >> 8)) >> 8;
+		cp[3] = gp[3];
+#else
+		z1 = gp[0] * gp[3] + 0x80;
+		z2 = gp[1] * gp[3] + 0x80;
+		z3 = gp[2] * gp[3] + 0x80;
+
+		cp[0] = gp[3];
+		cp[1] = (z1 + (z1 >> 8)) >> 8;
+		cp[2] = (z2 + (z2 >> 8)) >> 8;
+		cp[3] = (z3 + (z3 >> 8)) >> 8;
+#endif
+		gp += 4;
+		cp += 4;
+	}
+}
+
+#ifdef OGURI_X86_SIMD
+// x86 is always little-endian, so these only implement that half of the
+// scalar versions above.
+
+__attribute__((target("ssse3")))
+static void swizzle_row_ssse3(
+		const guint8 * gp, unsigned char * cp, int width) {
+	const __m128i shuffle = _mm_setr_epi8(
+			2, 1, 0, -128, 5, 4, 3, -128, 8, 7, 6, -128, 11, 10, 9, -128);
+	const __m128i opaque = _mm_set1_epi32((int)0xff000000);
+
+	// Every load reads 16 bytes but only uses 12 of them, so stop while
+	// there's still enough row left that we never read past the end of it.
+	int x = 0;
+	for (; x + 6 <= width; x += 4) {
+		__m128i in = _mm_loadu_si128((const __m128i *)(gp + 3 * x));
+		__m128i out = _mm_or_si128(_mm_shuffle_epi8(in, shuffle), opaque);
+		_mm_storeu_si128((__m128i *)(cp + 4 * x), out);
+	}
+	swizzle_row_scalar(gp + 3 * x, cp + 4 * x, width - x);
+}
+
+__attribute__((target("avx2")))
+static void swizzle_row_avx2(
+		const guint8 * gp, unsigned char * cp, int width) {
+	const __m256i shuffle = _mm256_broadcastsi128_si256(_mm_setr_epi8(
+			2, 1, 0, -128, 5, 4, 3, -128, 8, 7, 6, -128, 11, 10, 9, -128));
+	const __m256i opaque = _mm256_set1_epi32((int)0xff000000);
+
+	// Same as above, but each half of the register gets four pixels.
+	int x = 0;
+	for (; x + 10 <= width; x += 8) {
+		__m128i lo = _mm_loadu_si128((const __m128i *)(gp + 3 * x));
+		__m128i hi = _mm_loadu_si128((const __m128i *)(gp + 3 * x + 12));
+		__m256i in = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+		__m256i out = _mm256_or_si256(
+				_mm256_shuffle_epi8(in, shuffle), opaque);
+		_mm256_storeu_si256((__m256i *)(cp + 4 * x), out);
+	}
+	swizzle_row_scalar(gp + 3 * x, cp + 4 * x, width - x);
+}
+
+// Premultiplies two RGBA pixels unpacked into 16-bit lanes, and swaps them to
+// BGRA on the way. The alpha lane is multiplied by 255, which the rounding
+// division turns back into the original alpha.
+__attribute__((target("sse2")))
+static inline __m128i premultiply_pixels_sse2(__m128i px) {
+	const __m128i color_mask = _mm_setr_epi16(-1, -1, -1, 0, -1, -1, -1, 0);
+	const __m128i alpha_lane = _mm_setr_epi16(0, 0, 0, 0xff, 0, 0, 0, 0xff);
+	const __m128i bias = _mm_set1_epi16(0x80);
+
+	__m128i alpha = _mm_shufflehi_epi16(
+			_mm_shufflelo_epi16(px, _MM_SHUFFLE(3, 3, 3, 3)),
+			_MM_SHUFFLE(3, 3, 3, 3));
+	alpha = _mm_or_si128(_mm_and_si128(alpha, color_mask), alpha_lane);
+
+	__m128i bgra = _mm_shufflehi_epi16(
+			_mm_shufflelo_epi16(px, _MM_SHUFFLE(3, 0, 1, 2)),
+			_MM_SHUFFLE(3, 0, 1, 2));
+
+	__m128i z = _mm_add_epi16(_mm_mullo_epi16(bgra, alpha), bias);
+	return _mm_srli_epi16(_mm_add_epi16(z, _mm_srli_epi16(z, 8)), 8);
+}
+
+__attribute__((target("sse2")))
+static void premultiply_row_sse2(
+		const guint8 * gp, unsigned char * cp, int width) {
+	const __m128i zero = _mm_setzero_si128();
+
+	int x = 0;
+	for (; x + 4 <= width; x += 4) {
+		__m128i in = _mm_loadu_si128((const __m128i *)(gp + 4 * x));
+		__m128i lo = premultiply_pixels_sse2(_mm_unpacklo_epi8(in, zero));
+		__m128i hi = premultiply_pixels_sse2(_mm_unpackhi_epi8(in, zero));
+		_mm_storeu_si128((__m128i *)(cp + 4 * x), _mm_packus_epi16(lo, hi));
+	}
+	premultiply_row_scalar(gp + 4 * x, cp + 4 * x, width - x);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i premultiply_pixels_avx2(__m256i px) {
+	const __m256i color_mask = _mm256_setr_epi16(
+			-1, -1, -1, 0, -1, -1, -1, 0, -1, -1, -1, 0, -1, -1, -1, 0);
+	const __m256i alpha_lane = _mm256_setr_epi16(
+			0, 0, 0, 0xff, 0, 0, 0, 0xff, 0, 0, 0, 0xff, 0, 0, 0, 0xff);
+	const __m256i bias = _mm256_set1_epi16(0x80);
+
+	__m256i alpha = _mm256_shufflehi_epi16(
+			_mm256_shufflelo_epi16(px, _MM_SHUFFLE(3, 3, 3, 3)),
+			_MM_SHUFFLE(3, 3, 3, 3));
+	alpha = _mm256_or_si256(_mm256_and_si256(alpha, color_mask), alpha_lane);
+
+	__m256i bgra = _mm256_shufflehi_epi16(
+			_mm256_shufflelo_epi16(px, _MM_SHUFFLE(3, 0, 1, 2)),
+			_MM_SHUFFLE(3, 0, 1, 2));
+
+	__m256i z = _mm256_add_epi16(_mm256_mullo_epi16(bgra, alpha), bias);
+	return _mm256_srli_epi16(_mm256_add_epi16(z, _mm256_srli_epi16(z, 8)), 8);
+}
+
+__attribute__((target("avx2")))
+static void premultiply_row_avx2(
+		const guint8 * gp, unsigned char * cp, int width) {
+	const __m256i zero = _mm256_setzero_si256();
+
+	// The unpacks and the pack both work within each 128-bit half, so the
+	// pixels come back out in the order they went in.
+	int x = 0;
+	for (; x + 8 <= width; x += 8) {
+		__m256i in = _mm256_loadu_si256((const __m256i *)(gp + 4 * x));
+		__m256i lo = premultiply_pixels_avx2(_mm256_unpacklo_epi8(in, zero));
+		__m256i hi = premultiply_pixels_avx2(_mm256_unpackhi_epi8(in, zero));
+		_mm256_storeu_si256((__m256i *)(cp + 4 * x),
+				_mm256_packus_epi16(lo, hi));
+	}
+	premultiply_row_scalar(gp + 4 * x, cp + 4 * x, width - x);
+}
+#endif
+
+// Frames are drawn on the worker threads too, so the choice is made once for
+// all of them.
+static pthread_once_t row_converters_once = PTHREAD_ONCE_INIT;
+static oguri_row_converter_t * swizzle_row = NULL;
+static oguri_row_converter_t * premultiply_row = NULL;
+
+static void select_row_converters(void) {
+	swizzle_row = swizzle_row_scalar;
+	premultiply_row = premultiply_row_scalar;
+
+#ifdef OGURI_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		swizzle_row = swizzle_row_avx2;
+		premultiply_row = premultiply_row_avx2;
+		return;
+	}
+	if (__builtin_cpu_supports("ssse3")) {
+		swizzle_row = swizzle_row_ssse3;
+	}
+	if (__builtin_cpu_supports("sse2")) {
+		premultiply_row = premultiply_row_sse2;
+	}
+#endif
+}
 
 int oguri_cairo_surface_paint_pixbuf(
 		cairo_surface_t * surface, const GdkPixbuf * pixbuf) {
@@ -30,74 +254,16 @@ int oguri_cairo_surface_paint_pixbuf(
 	int target_stride = cairo_image_surface_get_stride(surface);
 	unsigned char * target_pixels = cairo_image_surface_get_data(surface);
 
-	if (chan == 3) {
-		for (int i = h; i; --i) {
-			const guint8 * gp = source_pixels;
-			unsigned char * cp = target_pixels;
-			const guint8 * end = gp + (3 * w);
-			while (gp < end) {
-#if G_BYTE_ORDER == G_LITTLE_ENDIAN
-				cp[0] = gp[2];
-				cp[1] = gp[1];
-				cp[2] = gp[0];
-#else
-				cp[1] = gp[0];
-				cp[2] = gp[1];
-				cp[3] = gp[2];
-#endif
-				gp += 3;
-				cp += 4;
-			}
-			source_pixels += source_stride;
-			target_pixels += target_stride;
-		}
-	} else {
-		/* premul-color = alpha/255 * color/255 * 255 = (alpha*color)/255
-		 * (z/255) = z/256 * 256/255     = z/256 (1 + 1/255)
-		 *         = z/256 + (z/256)/255 = (z + z/255)/256
-		 *         # recurse once
-		 *         = (z + (z + z/255)/256)/256
-		 *         = (z + z/256 + z/256/255) / 256
-		 *         # only use 16bit uint operations, loose some precision,
-		 *         # result is floored.
-		 *       ->  (z + z>>8)>>8
-		 *         # add 0x80/255 = 0.5 to convert floor to round
-		 *       =>  (z+0x80 + (z+0x80)>>8 ) >> 8
-		 * ------
-		 * tested as equal to lround(z/255.0) for uint z in [0..0xfe02]
-		 */
-		for (int i = h; i; --i) {
-			const guint8 * gp = source_pixels;
-			unsigned char * cp = target_pixels;
-			const guint8 * end = gp + (4 * w);
-			guint z1, z2, z3;
-			while (gp < end) {
-#if G_BYTE_ORDER == G_LITTLE_ENDIAN
-				z1 = gp[2] * gp[3] + 0x80;
-				z2 = gp[1] * gp[3] + 0x80;
-				z3 = gp[0] * gp[3] + 0x80;
-
-				cp[0] = (z1 + (z1 >> 8)) >> 8;
-				cp[1] = (z2 + (z2 >> 8)) >> 8;
-				cp[2] = (z3 + (z3 >> 8)) >> 8;
-				cp[3] = gp[3];
-#else
-				z1 = gp[0] * gp[3] + 0x80;
-				z2 = gp[1] * gp[3] + 0x80;
-				z3 = gp[2] * gp[3] + 0x80;
-
-				cp[0] = gp[3];
-				cp[1] = (z1 + (z1 >> 8)) >> 8;
-				cp[2] = (z2 + (z2 >> 8)) >> 8;
-				cp[3] = (z3 + (z3 >> 8)) >> 8;
-#endif
-				gp += 4;
-				cp += 4;
-			}
-			source_pixels += source_stride;
-			target_pixels += target_stride;
-		}
+	pthread_once(&row_converters_once, select_row_converters);
+	oguri_row_converter_t * convert_row =
+		(chan == 3) ? swizzle_row : premultiply_row;
+
+	for (int i = h; i; --i) {
+		convert_row(source_pixels, target_pixels, w);
+		source_pixels += source_stride;
+		target_pixels += target_stride;
 	}
+
 	cairo_surface_mark_dirty(surface);
 	return 0;
 }
@@ -2,6 +2,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <libgen.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -100,13 +101,101 @@ void oguri_output_config_destroy(struct oguri_output_config * opc) {
 // Configurators
 //
 
+// Parses a size in bytes, optionally followed by a K, M or G suffix.
+static bool parse_size(const char * value, size_t * size) {
+	char * end;
+	errno = 0;
+	unsigned long long parsed = strtoull(value, &end, 10);
+	if (errno || end == value || value[0] == '-') {
+		return false;
+	}
+
+	unsigned int shift = 0;
+	switch (*end) {
+	case 'G':
+		shift += 10;
+		// fallthrough
+	case 'M':
+		shift += 10;
+		// fallthrough
+	case 'K':
+		shift += 10;
+		++end;
+		break;
+	}
+	if (*end != '\0' || parsed > (SIZE_MAX >> shift)) {
+		return false;
+	}
+
+	*size = (size_t)parsed << shift;
+	return true;
+}
+
 bool configure_global(
-		struct oguri_state * oguri __attribute__((unused)),
+		struct oguri_state * oguri,
 		char * name __attribute__((unused)),
-		char * property __attribute__((unused)),
-		char * value __attribute__((unused))) {
-	fprintf(stderr, "Not in an output section\n");
-	return false;
+		char * property,
+		char * value) {
+	if (strcmp(property, "max-cache-memory") == 0) {
+		if (strcmp(value, "unlimited") == 0) {
+			oguri->max_cache_memory = SIZE_MAX;
+			return true;
+		}
+		else if (parse_size(value, &oguri->max_cache_memory)) {
+			return true;
+		}
+		else {
+			fprintf(stderr, "Invalid memory size: '%s'\n", value);
+			return false;
+		}
+	}
+	else if (strcmp(property, "render-ahead") == 0) {
+		if (strcmp(value, "true") == 0) {
+			oguri->render_ahead = true;
+			return true;
+		}
+		else if (strcmp(value, "false") == 0) {
+			oguri->render_ahead = false;
+			return true;
+		}
+		else {
+			fprintf(stderr, "Expected true or false: '%s'\n", value);
+			return false;
+		}
+	}
+	else if (strcmp(property, "threads") == 0) {
+		if (strcmp(value, "auto") == 0) {
+			oguri->thread_count = -1;
+			return true;
+		}
+
+		char * end;
+		errno = 0;
+		long count = strtol(value, &end, 10);
+		if (errno || end == value || *end != '\0' ||
+				count < 0 || count > OGURI_MAX_THREADS) {
+			fprintf(stderr, "Invalid thread count: '%s'\n", value);
+			return false;
+		}
+		oguri->thread_count = count;
+		return true;
+	}
+	else if (strcmp(property, "timer-slack") == 0) {
+		char * end;
+		errno = 0;
+		long slack = strtol(value, &end, 10);
+		if (errno || end == value || *end != '\0' ||
+				slack < 0 || slack > OGURI_MAX_TIMER_SLACK) {
+			fprintf(stderr, "Invalid timer slack: '%s'\n", value);
+			return false;
+		}
+		oguri->timer_slack = slack;
+		return true;
+	}
+	else {
+		fprintf(stderr, "Invalid global property: '%s'\n", property);
+		return false;
+	}
 }
 
 bool configure_output(
@@ -245,6 +334,34 @@ bool configure_output(
 			return false;
 		}
 	}
+	else if (strcmp(property, "compositor-scaling") == 0) {
+		if (strcmp(value, "true") == 0) {
+			output->compositor_scaling = true;
+			return true;
+		}
+		else if (strcmp(value, "false") == 0) {
+			output->compositor_scaling = false;
+			return true;
+		}
+		else {
+			fprintf(stderr, "Expected true or false: '%s'\n", value);
+			return false;
+		}
+	}
+	else if (strcmp(property, "compressed-cache") == 0) {
+		if (strcmp(value, "true") == 0) {
+			output->compressed_cache = true;
+			return true;
+		}
+		else if (strcmp(value, "false") == 0) {
+			output->compressed_cache = false;
+			return true;
+		}
+		else {
+			fprintf(stderr, "Expected true or false: '%s'\n", value);
+			return false;
+		}
+	}
 	else {
 		fprintf(stderr, "Invalid output property: '%s'\n", property);
 		return false;
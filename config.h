@@ -15,6 +15,14 @@ struct oguri_output_config {
 
 	cairo_filter_t filter;
 
+	// Hand the image to the compositor at its native size and have it do the
+	// scaling, if it supports wp_viewporter.
+	bool compositor_scaling;
+
+	// Keep cached frames run-length encoded, trading a little time on every
+	// frame for a lot less memory.
+	bool compressed_cache;
+
 	enum {
 		SCALING_MODE_FILL,
 		SCALING_MODE_STRETCH,
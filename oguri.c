@@ -12,9 +12,11 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -22,11 +24,24 @@
 #include "cairo.h"
 #include "wlr-layer-shell-unstable-v1-client-protocol.h"
 #include "xdg-output-unstable-v1-client-protocol.h"
+#include "viewporter-client-protocol.h"
 
 #include "oguri.h"
 #include "animation.h"
+#include "buffers.h"
+#include "cache.h"
 #include "config.h"
 #include "output.h"
+#include "timers.h"
+#include "workers.h"
+
+// How many ready fds are picked up from epoll at once. Any more just wait
+// for the next time around the main loop.
+#define OGURI_MAX_READY_EVENTS 32
+
+// The most an IPC client may send in one command, which is plenty for any
+// configuration.
+#define OGURI_MAX_IPC_INPUT (1024 * 1024)
 
 //
 // Signal handler
@@ -41,6 +56,127 @@ void signal_handler(int number) {
 	}
 }
 
+static void handle_signal(
+		struct oguri_state * oguri,
+		struct oguri_event_source * source,
+		uint32_t events __attribute__((unused))) {
+	int signal_number;
+	const ssize_t size = sizeof(signal_number);
+	if (read(source->fd, &signal_number, size) < size) {
+		// Do nothing, I guess?
+	}
+	else {
+		if (signal_number == SIGINT ||
+				signal_number == SIGTERM ||
+				signal_number == SIGQUIT) {
+			oguri->run = false;
+		}
+	}
+}
+
+//
+// Event sources
+//
+
+bool oguri_add_event_source(struct oguri_state * oguri,
+		struct oguri_event_source * source, uint32_t events) {
+	struct epoll_event event = {
+		.events = events,
+		.data.ptr = source,
+	};
+	if (epoll_ctl(oguri->epoll_fd, EPOLL_CTL_ADD, source->fd, &event) < 0) {
+		fprintf(stderr, "Could not watch fd %d: %s\n",
+				source->fd, strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+bool oguri_modify_event_source(struct oguri_state * oguri,
+		struct oguri_event_source * source, uint32_t events) {
+	struct epoll_event event = {
+		.events = events,
+		.data.ptr = source,
+	};
+	if (epoll_ctl(oguri->epoll_fd, EPOLL_CTL_MOD, source->fd, &event) < 0) {
+		fprintf(stderr, "Could not watch fd %d: %s\n",
+				source->fd, strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+// The source must be removed before its fd is closed, or epoll might still
+// hand it back from a duplicate of the fd.
+void oguri_remove_event_source(struct oguri_state * oguri,
+		struct oguri_event_source * source) {
+	if (epoll_ctl(oguri->epoll_fd, EPOLL_CTL_DEL, source->fd, NULL) < 0) {
+		fprintf(stderr, "Could not stop watching fd %d: %s\n",
+				source->fd, strerror(errno));
+	}
+}
+
+static void handle_workers(
+		struct oguri_state * oguri,
+		struct oguri_event_source * source __attribute__((unused)),
+		uint32_t events __attribute__((unused))) {
+	// Frames drawn in the background are ready to be shown.
+	oguri_workers_collect(oguri->workers);
+}
+
+static void handle_timers(
+		struct oguri_state * oguri,
+		struct oguri_event_source * source __attribute__((unused)),
+		uint32_t events __attribute__((unused))) {
+	// Everything the animations commit goes out in one flush at the top of
+	// the main loop.
+	oguri_timers_run(oguri->timers, oguri->timer_slack * (uint64_t)1000000);
+}
+
+//
+// Wayland connection
+//
+
+// Brings every output which was held back while the compositor caught up to
+// the current frame, in one commit each.
+static void release_held_outputs(struct oguri_state * oguri) {
+	struct oguri_animation * anim;
+	struct oguri_output * output;
+	wl_list_for_each(anim, &oguri->animations, link) {
+		wl_list_for_each(output, &anim->outputs, link) {
+			if (output->held) {
+				output->held = false;
+				oguri_animation_refresh_output(output);
+			}
+		}
+	}
+}
+
+// Sends everything we've asked of the compositor without ever waiting on it.
+// If it isn't reading fast enough, the rest stays queued until the socket is
+// writable again, and outputs stop committing frames in the meantime rather
+// than piling more on top.
+static void flush_display(struct oguri_state * oguri) {
+	while (wl_display_flush(oguri->display) >= 0) {
+		if (!oguri->flush_blocked) {
+			return;
+		}
+		oguri->flush_blocked = false;
+		oguri_modify_event_source(oguri, &oguri->wayland_source, EPOLLIN);
+		release_held_outputs(oguri);  // Which has more to send.
+	}
+
+	// A broken connection shows up when reading, and is dealt with there.
+	if (errno != EAGAIN || oguri->flush_blocked) {
+		return;
+	}
+	oguri->flush_blocked = true;
+	++oguri->flush_stalls;
+	oguri_modify_event_source(
+			oguri, &oguri->wayland_source, EPOLLIN | EPOLLOUT);
+}
+
+
 //
 // Wayland registry
 //
@@ -52,12 +188,14 @@ static void handle_registry(
 		struct wl_registry * registry,
 		uint32_t name,
 		const char * interface,
-		uint32_t version __attribute__((unused))) {
+		uint32_t version) {
 	struct oguri_state * oguri = data;
 
 	if (strcmp(interface, wl_compositor_interface.name) == 0) {
-		oguri->compositor = wl_registry_bind(
-				registry, name, &wl_compositor_interface, 3);
+		// Version 4 lets us damage in buffer coordinates, but we can live
+		// without it.
+		oguri->compositor = wl_registry_bind(registry, name,
+				&wl_compositor_interface, (version < 4) ? 3 : 4);
 	}
 	else if (strcmp(interface, wl_shm_interface.name) == 0) {
 		oguri->shm = wl_registry_bind(registry, name, &wl_shm_interface, 1);
@@ -75,6 +213,10 @@ static void handle_registry(
 		oguri->layer_shell = wl_registry_bind(
 				registry, name, &zwlr_layer_shell_v1_interface, 1);
 	}
+	else if (strcmp(interface, wp_viewporter_interface.name) == 0) {
+		oguri->viewporter = wl_registry_bind(
+				registry, name, &wp_viewporter_interface, 1);
+	}
 }
 
 static const struct wl_registry_listener registry_listener = {
@@ -118,7 +260,7 @@ static int oguri_ipc_create(struct oguri_state * oguri) {
 		return -1;
 	}
 
-	if (listen(sock_fd, 1) == -1) {
+	if (listen(sock_fd, SOMAXCONN) == -1) {
 		perror("Unable to listen on IPC socket, IPC is disabled");
 		return -1;
 	}
@@ -126,43 +268,264 @@ static int oguri_ipc_create(struct oguri_state * oguri) {
 	return sock_fd;
 }
 
+// Each connection gets one command, and is closed once it's been handled.
+// Whatever the client sends is kept until there's enough of it to act on, so
+// a command which arrives in pieces is never mistaken for another. Replies
+// which don't fit in the socket all at once are kept until it's writable
+// again, rather than holding up the main loop on a slow client.
+struct oguri_ipc_client {
+	struct oguri_event_source source;
+	struct wl_list link;  // oguri_state::ipc_clients
+
+	char * input;
+	size_t input_length;
+	size_t input_allocated;
+
+	char * reply;  // NULL until there is one.
+	size_t reply_length;
+	size_t reply_sent;
+};
+
+static void oguri_ipc_client_destroy(
+		struct oguri_state * oguri, struct oguri_ipc_client * client) {
+	oguri_remove_event_source(oguri, &client->source);
+	close(client->source.fd);
+	wl_list_remove(&client->link);
+	free(client->input);
+	free(client->reply);
+	free(client);
+}
+
 static void oguri_ipc_destroy(struct oguri_state * oguri) {
-	close(oguri->events[OGURI_IPC_CONNECT_EVENT].fd);
-	unlink(oguri->ipc_sock.sun_path);
-	// TODO: Gracefully disconnect a client if one exists.
+	struct oguri_ipc_client * client, * tmp;
+	wl_list_for_each_safe(client, tmp, &oguri->ipc_clients, link) {
+		oguri_ipc_client_destroy(oguri, client);
+	}
+	if (oguri->ipc_source.fd != -1) {
+		close(oguri->ipc_source.fd);
+		unlink(oguri->ipc_sock.sun_path);
+	}
 }
 
-static void oguri_ipc_handle_command(
-		struct oguri_state * oguri, const int client) {
-	// Duplicate the IPC descriptor before attempting to load config from it
-	// because load_config closes the descriptor when it's done.
-	int config_fd = dup(client);
-	if (config_fd < 0) {
-		perror("Could not duplicate IPC file descriptor");
-		if (write(client, "Unable to read config from IPC\n", 32) < 0) {
+// Writes as much of the reply as the socket will take. Returns whether there
+// is any left to send once it's writable again.
+static bool oguri_ipc_client_send(struct oguri_ipc_client * client) {
+	while (client->reply_sent < client->reply_length) {
+		ssize_t sent = write(client->source.fd,
+				client->reply + client->reply_sent,
+				client->reply_length - client->reply_sent);
+		if (sent < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN) {
+				return true;
+			}
 			fprintf(stderr, "Error replying to ipc command\n");
+			return false;
+		}
+		client->reply_sent += sent;
+	}
+	return false;
+}
+
+// Reads whatever the client has sent so far. Returns false if it can't be
+// read, or there's too much of it. Sets *closed once the client has sent
+// everything it's going to.
+static bool oguri_ipc_client_receive(
+		struct oguri_ipc_client * client, bool * closed) {
+	*closed = false;
+	while (true) {
+		if (client->input_length == client->input_allocated) {
+			if (client->input_allocated >= OGURI_MAX_IPC_INPUT) {
+				fprintf(stderr, "IPC command is too long\n");
+				return false;
+			}
+			size_t allocated = client->input_allocated ?
+				client->input_allocated * 2 : 256;
+			char * input = realloc(client->input, allocated);
+			if (!input) {
+				perror("Could not read IPC command");
+				return false;
+			}
+			client->input = input;
+			client->input_allocated = allocated;
+		}
+
+		ssize_t received = read(client->source.fd,
+				client->input + client->input_length,
+				client->input_allocated - client->input_length);
+		if (received < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN) {
+				return true;
+			}
+			perror("Could not read IPC command");
+			return false;
+		}
+		if (received == 0) {
+			*closed = true;
+			return true;
+		}
+		client->input_length += received;
+	}
+}
+
+static void oguri_ipc_client_reply(
+		struct oguri_ipc_client * client, const char * message) {
+	client->reply = strdup(message);
+	client->reply_length = client->reply ? strlen(message) : 0;
+}
+
+static bool oguri_ipc_format_stats(
+		struct oguri_state * oguri, struct oguri_ipc_client * client) {
+	FILE * stream = open_memstream(&client->reply, &client->reply_length);
+	if (!stream) {
+		perror("Could not open IPC stream");
+		return false;
+	}
+
+	fprintf(stream, "cache: %.1f MiB", oguri->cache_memory / (1024.0 * 1024.0));
+	if (oguri->max_cache_memory != SIZE_MAX) {
+		fprintf(stream, " of %.1f MiB",
+				oguri->max_cache_memory / (1024.0 * 1024.0));
+	}
+	fprintf(stream, "\n");
+	oguri_timers_print_stats(oguri->timers, stream);
+	if (oguri->flush_stalls) {
+		fprintf(stream, "wayland: the compositor fell behind on reading %u "
+				"times%s\n", oguri->flush_stalls,
+				oguri->flush_blocked ? ", and still is" : "");
+	}
+
+	struct oguri_animation * anim;
+	struct oguri_frame_cache * cache;
+	struct oguri_output * output;
+	wl_list_for_each(anim, &oguri->animations, link) {
+		oguri_animation_print_stats(anim, stream);
+		wl_list_for_each(cache, &anim->caches, link) {
+			oguri_frame_cache_print_stats(cache, stream);
+		}
+		wl_list_for_each(output, &anim->outputs, link) {
+			oguri_output_print_stats(output, stream);
 		}
-		close(client);
+	}
+	wl_list_for_each(output, &oguri->idle_outputs, link) {
+		oguri_output_print_stats(output, stream);
+	}
+
+	if (fclose(stream) != 0) {
+		fprintf(stderr, "Could not format IPC reply\n");
+		return false;
+	}
+	return true;
+}
+
+static bool oguri_ipc_is_stats_request(
+		const struct oguri_ipc_client * client) {
+	static const char stats_command[] = "stats\n";
+	return client->input_length >= sizeof(stats_command) - 1 &&
+		memcmp(client->input, stats_command, sizeof(stats_command) - 1) == 0;
+}
+
+static void oguri_ipc_load_config(
+		struct oguri_state * oguri, struct oguri_ipc_client * client) {
+	FILE * ipc_config = fmemopen(client->input, client->input_length, "r");
+	if (!ipc_config) {
+		perror("Could not read config from IPC");
+		oguri_ipc_client_reply(client, "Unable to read config from IPC\n");
 		return;
 	}
 
-	FILE * ipc_config = fdopen(config_fd, "r");
 	int loaded = load_config(oguri, ipc_config, "ipc");
 	if (loaded == -1) {
 		// TODO: Expose the error messages instead of writing them to oguri's
 		// stderr, where they will go nowhere.
-		if (write(client, "Invalid configuration\n", 23) < 0) {
-			fprintf(stderr, "Error replying to ipc command\n");
-		}
+		oguri_ipc_client_reply(client, "Invalid configuration\n");
 	}
 
 	// TODO: If there was an error reading the config, we might have partially
 	// applied it. We're going to reconfig so that nothing gets out of sync
 	// internally, but this should be fixed in the config handlers.
 	oguri_reconfigure(oguri);
+}
+
+static void handle_ipc_client(
+		struct oguri_state * oguri,
+		struct oguri_event_source * source,
+		uint32_t events __attribute__((unused))) {
+	struct oguri_ipc_client * client =
+		wl_container_of(source, client, source);
+
+	// Once there's a reply, we're only waiting to send the rest of it.
+	if (client->reply) {
+		if (!oguri_ipc_client_send(client)) {
+			oguri_ipc_client_destroy(oguri, client);
+		}
+		return;
+	}
+
+	bool closed;
+	if (!oguri_ipc_client_receive(client, &closed)) {
+		oguri_ipc_client_destroy(oguri, client);
+		return;
+	}
+
+	// A stats request can be answered as soon as its first line is in.
+	// Everything else is configuration, which has to be read in full.
+	if (oguri_ipc_is_stats_request(client)) {
+		if (!oguri_ipc_format_stats(oguri, client)) {
+			oguri_ipc_client_destroy(oguri, client);
+			return;
+		}
+	}
+	else if (closed) {
+		oguri_ipc_load_config(oguri, client);
+	}
+	else {
+		return;
+	}
 
-	close(client);
-	oguri->events[OGURI_IPC_CLIENT_EVENT].fd = -1;
+	if (!client->reply || !oguri_ipc_client_send(client) ||
+			!oguri_modify_event_source(oguri, source, EPOLLOUT)) {
+		oguri_ipc_client_destroy(oguri, client);
+	}
+}
+
+static void handle_ipc_connect(
+		struct oguri_state * oguri,
+		struct oguri_event_source * source,
+		uint32_t events __attribute__((unused))) {
+	int fd = accept(source->fd, NULL, NULL);
+	if (fd == -1) {
+		return;
+	}
+
+	int flags;
+	if ((flags = fcntl(fd, F_GETFL)) == -1 ||
+			fcntl(fd, F_SETFL, flags|O_NONBLOCK) == -1) {
+		perror("Unable to set nonblocking on IPC client socket");
+		close(fd);
+		return;
+	}
+
+	struct oguri_ipc_client * client = calloc(1, sizeof(struct oguri_ipc_client));
+	if (!client) {
+		close(fd);
+		return;
+	}
+	client->source = (struct oguri_event_source) {
+		.fd = fd,
+		.handle = handle_ipc_client,
+	};
+	if (!oguri_add_event_source(oguri, &client->source, EPOLLIN)) {
+		close(fd);
+		free(client);
+		return;
+	}
+	wl_list_insert(&oguri->ipc_clients, &client->link);
 }
 
 //
@@ -188,11 +551,14 @@ void oguri_reconfigure(struct oguri_state * oguri) {
 	}
 
 	// Now attempt to associate each output with its config, and therefore
-	// animation. This might create new animations as needed.
+	// animation. This might create new animations as needed. Animations
+	// aren't destroyed until the end, so an output's previous one can still
+	// be told apart from any new ones.
 	struct oguri_output * output, * tmp;
 	wl_list_for_each_safe(output, tmp, &oguri->idle_outputs, link) {
+		struct oguri_animation * previous_anim = output->anim;
+		output->anim = NULL;
 		output->config = NULL;
-		output->cached_frames = 0;
 
 		struct oguri_output_config * opc, * wildcard_opc = NULL;
 		wl_list_for_each(opc, &output->oguri->output_configs, link) {
@@ -235,11 +601,20 @@ void oguri_reconfigure(struct oguri_state * oguri) {
 		if (found_anim) {
 			wl_list_remove(&output->link);
 			wl_list_insert(found_anim->outputs.prev, &output->link);
+			output->anim = found_anim;
 
 			// Force a render to ensure there's a frame displayed on the output
 			// even if the configured image is static.
 			oguri_animation_schedule_frame(found_anim, 1);
 		}
+
+		// Frame numbers and caches from another animation don't mean anything
+		// here. If the output stays on the same one, it keeps its cache until
+		// the next frame finds out whether the new configuration still fits.
+		if (output->anim != previous_anim) {
+			oguri_frame_cache_detach(output);
+			output->shown_frame = -1;
+		}
 	}
 
 	// Finally, clean up any animations which no longer have any outputs.
@@ -266,9 +641,15 @@ static const char usage[] =
 
 int main(int argc, char * argv[]) {
 	struct oguri_state oguri = {0};
+	oguri.max_cache_memory = SIZE_MAX;
+	oguri.thread_count = -1;
+	oguri.render_ahead = true;
+	oguri.timer_slack = 2;
 	wl_list_init(&oguri.output_configs);
 	wl_list_init(&oguri.idle_outputs);
 	wl_list_init(&oguri.animations);
+	wl_list_init(&oguri.ipc_clients);
+	wl_list_init(&oguri.orphaned_pools);
 
 	char * config_path = strdup("$XDG_CONFIG_HOME/oguri/config");
 
@@ -307,28 +688,41 @@ int main(int argc, char * argv[]) {
 	oguri.display = wl_display_connect(NULL);
 	assert(oguri.display);
 
-	oguri.events[OGURI_SIGNAL_EVENT] = (struct pollfd) {
+	oguri.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (oguri.epoll_fd < 0) {
+		perror("Unable to create epoll instance");
+		return 1;
+	}
+
+	oguri.signal_source = (struct oguri_event_source) {
 		.fd = signal_pipe[0],
-		.events = POLLIN,
+		.handle = handle_signal,
 	};
-	oguri.events[OGURI_WAYLAND_EVENT] = (struct pollfd) {
+	oguri.wayland_source = (struct oguri_event_source) {
 		.fd = wl_display_get_fd(oguri.display),
-		.events = POLLIN,
 	};
-	oguri.events[OGURI_IPC_CONNECT_EVENT] = (struct pollfd) {
+	oguri.ipc_source = (struct oguri_event_source) {
 		.fd = oguri_ipc_create(&oguri),
-		.events = POLLIN,
-	};
-	oguri.events[OGURI_IPC_CLIENT_EVENT] = (struct pollfd) {
-		.fd = -1,  // This event is idle when no client is connected.
-		.events = POLLIN,
+		.handle = handle_ipc_connect,
 	};
+	if (!oguri_add_event_source(&oguri, &oguri.signal_source, EPOLLIN) ||
+			!oguri_add_event_source(&oguri, &oguri.wayland_source, EPOLLIN)) {
+		return 1;
+	}
+	if (oguri.ipc_source.fd != -1) {
+		oguri_add_event_source(&oguri, &oguri.ipc_source, EPOLLIN);
+	}
 
-	// Fill in the rest of the event fds with -1.
-	for (size_t i = OGURI_FIRST_ANIM_EVENT; i < OGURI_EVENT_COUNT; ++i) {
-		oguri.events[i] = (struct pollfd) {
-			.fd = -1,
-		};
+	oguri.timers = oguri_timers_create();
+	if (!oguri.timers) {
+		return 1;
+	}
+	oguri.timer_source = (struct oguri_event_source) {
+		.fd = oguri_timers_get_fd(oguri.timers),
+		.handle = handle_timers,
+	};
+	if (!oguri_add_event_source(&oguri, &oguri.timer_source, EPOLLIN)) {
+		return 1;
 	}
 
 	oguri.registry = wl_display_get_registry(oguri.display);
@@ -342,6 +736,29 @@ int main(int argc, char * argv[]) {
 		return 1;
 	}
 
+	// Frames are drawn ahead of time, and big ones split up, on as many
+	// threads as there are CPUs unless configured otherwise.
+	long thread_count = oguri.thread_count;
+	if (thread_count < 0) {
+		thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+		if (thread_count < 1) {
+			thread_count = 1;
+		}
+		else if (thread_count > OGURI_MAX_THREADS) {
+			thread_count = OGURI_MAX_THREADS;
+		}
+	}
+	if (thread_count > 0) {
+		oguri.workers = oguri_workers_create(thread_count);
+	}
+	if (oguri.workers) {
+		oguri.worker_source = (struct oguri_event_source) {
+			.fd = oguri_workers_get_fd(oguri.workers),
+			.handle = handle_workers,
+		};
+		oguri_add_event_source(&oguri, &oguri.worker_source, EPOLLIN);
+	}
+
 	oguri_reconfigure(&oguri);
 
 	oguri.run = true;
@@ -349,32 +766,29 @@ int main(int argc, char * argv[]) {
 		while (wl_display_prepare_read(oguri.display) != 0) {
 			wl_display_dispatch_pending(oguri.display);
 		}
-		wl_display_flush(oguri.display);
+		flush_display(&oguri);
 
-		int polled = poll(oguri.events, OGURI_EVENT_COUNT, -1);
-		if (polled < 0) {
+		struct epoll_event ready[OGURI_MAX_READY_EVENTS];
+		int count = epoll_wait(
+				oguri.epoll_fd, ready, OGURI_MAX_READY_EVENTS, -1);
+		if (count < 0) {
 			wl_display_cancel_read(oguri.display);
 			continue;
 		}
 
-		if (oguri.events[OGURI_SIGNAL_EVENT].revents & POLLIN) {
-			int signal_number;
-			const ssize_t size = sizeof(signal_number);
-			if (read(signal_pipe[0], &signal_number, size) < size) {
-				// Do nothing, I guess?
-			}
-			else {
-				if (signal_number == SIGINT ||
-						signal_number == SIGTERM ||
-						signal_number == SIGQUIT) {
-					oguri.run = false;
-				}
-			}
-		}
-
 		// Read wayland events first so we can handle any resizing, etc, before
-		// attempting to draw again.
-		if (oguri.events[OGURI_WAYLAND_EVENT].revents & POLLIN) {
+		// attempting to draw again. Frames are drawn last for the same reason,
+		// and so that whatever the workers just finished is there to be shown.
+		bool wayland_ready = false;
+		bool timers_ready = false;
+		for (int i = 0; i < count; ++i) {
+			// Only being writable again just means the flush at the top of
+			// the loop can carry on.
+			wayland_ready |= ready[i].data.ptr == &oguri.wayland_source &&
+				(ready[i].events & ~EPOLLOUT);
+			timers_ready |= ready[i].data.ptr == &oguri.timer_source;
+		}
+		if (wayland_ready) {
 			if (wl_display_read_events(oguri.display) != 0) {
 				if (errno == 104) {
 					// Compositor disconnected us, exit quietly.
@@ -390,56 +804,22 @@ int main(int argc, char * argv[]) {
 			wl_display_cancel_read(oguri.display);
 		}
 
+		for (int i = 0; i < count && oguri.run; ++i) {
+			struct oguri_event_source * source = ready[i].data.ptr;
+			if (source != &oguri.wayland_source &&
+					source != &oguri.timer_source) {
+				source->handle(&oguri, source, ready[i].events);
+			}
+		}
+
 		// At this point, we may have been shut down. Might as well not waste
 		// time drawing.
 		if (!oguri.run) {
 			break;
 		}
 
-		// Check for a new IPC connection.
-		if (oguri.events[OGURI_IPC_CONNECT_EVENT].revents & POLLIN) {
-			// If accept fails for some reason, it will return -1. We just let
-			// that happen, because it will simply disable the client pollfd.
-			int client = accept(oguri.events[OGURI_IPC_CONNECT_EVENT].fd,
-					NULL, NULL);
-
-			if (client != -1) {
-				int flags;
-				if ((flags = fcntl(client, F_GETFL)) == -1 ||
-						fcntl(client, F_SETFL, flags|O_NONBLOCK) == -1) {
-					perror("Unable to set nonblocking on IPC client socket");
-					close(client);
-					client = -1;
-				}
-			}
-
-			oguri.events[OGURI_IPC_CLIENT_EVENT].fd = client;
-		}
-
-		if (oguri.events[OGURI_IPC_CLIENT_EVENT].revents & POLLIN) {
-			int client = oguri.events[OGURI_IPC_CLIENT_EVENT].fd;
-			oguri_ipc_handle_command(&oguri, client);
-		}
-
-		// Now see if we need to draw any frames.
-		struct oguri_animation * anim;
-		wl_list_for_each(anim, &oguri.animations, link) {
-			if (oguri.events[anim->event_index].revents & POLLIN) {
-				uint64_t expirations;
-				ssize_t n = read(
-						oguri.events[anim->event_index].fd,
-						&expirations,
-						sizeof(expirations));
-
-				if (n < 0) {
-					fprintf(stderr, "Failed to read timer events\n");
-					break;
-				}
-
-				// This will update the animation's timerfd automatically if
-				// neccessary. (Spooky!)
-				oguri_render_frame(anim);
-			}
+		if (timers_ready) {
+			oguri.timer_source.handle(&oguri, &oguri.timer_source, 0);
 		}
 	}
 
@@ -448,6 +828,14 @@ int main(int argc, char * argv[]) {
 		oguri_animation_destroy(anim);
 	}
 
+	oguri_timers_destroy(oguri.timers);
+
+	// Any jobs still in flight belonged to animations which are gone now, and
+	// are cleaned up as they're collected.
+	if (oguri.workers) {
+		oguri_workers_destroy(oguri.workers);
+	}
+
 	// At this point, because we've destroyed all of the animations, all
 	// outputs should be idle again and will be cleaned up here.
 	struct oguri_output * output, * output_tmp;
@@ -460,8 +848,14 @@ int main(int argc, char * argv[]) {
 	    oguri_output_config_destroy(opc);
 	}
 
+	oguri_buffers_destroy_orphans(&oguri);
+
 	oguri_ipc_destroy(&oguri);
+	close(oguri.epoll_fd);
 
+	if (oguri.viewporter) {
+		wp_viewporter_destroy(oguri.viewporter);
+	}
 	zxdg_output_manager_v1_destroy(oguri.output_manager);
 	zwlr_layer_shell_v1_destroy(oguri.layer_shell);
 
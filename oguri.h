@@ -1,27 +1,50 @@
 #ifndef OGURI_H
 #define OGURI_H
 
-#include <poll.h>
 #include <sys/un.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <wayland-client.h>
 
-// Maximum number of events we can keep track of, including both the reserved
-// slots below and any active animations.
-#define OGURI_EVENT_COUNT 25
-
-// These are used to reserve a few pollfd slots for static stuff.
-enum oguri_events {
-	OGURI_SIGNAL_EVENT,
-	OGURI_WAYLAND_EVENT,
-	OGURI_IPC_CONNECT_EVENT,
-	OGURI_IPC_CLIENT_EVENT,
-	OGURI_FIRST_ANIM_EVENT,  // last
+struct oguri_state;
+struct oguri_timers;
+struct oguri_workers;
+
+// More than this many threads would just be getting in each other's way.
+#define OGURI_MAX_THREADS 64
+
+// Frames can't be let off any earlier than this to share a wakeup.
+#define OGURI_MAX_TIMER_SLACK 100
+
+struct oguri_event_source;
+typedef void oguri_event_fn(struct oguri_state * oguri,
+		struct oguri_event_source * source, uint32_t events);
+
+// A file descriptor the main loop waits on, embedded in whatever it belongs
+// to. handle is called with the epoll events once it's ready. There can be
+// any number of them, and only the ready ones are looked at.
+struct oguri_event_source {
+	int fd;
+	oguri_event_fn * handle;
 };
 
 struct oguri_state {
 	bool run;
-	struct pollfd events[OGURI_EVENT_COUNT];
+	int epoll_fd;
+
+	struct oguri_event_source signal_source;
+	struct oguri_event_source wayland_source;  // Read by the main loop itself.
+	struct oguri_event_source ipc_source;  // Listening for new clients.
+	struct oguri_event_source worker_source;
+	struct oguri_event_source timer_source;
+	struct wl_list ipc_clients;  // oguri_ipc_client::link
+
+	// The compositor hasn't read everything we've sent it yet. No frames are
+	// committed until it has, and the Wayland fd is watched for EPOLLOUT to
+	// find out when that is.
+	bool flush_blocked;
+	unsigned int flush_stalls;
 
 	struct wl_display * display;
 	struct wl_registry * registry;
@@ -30,14 +53,44 @@ struct oguri_state {
 
 	struct zwlr_layer_shell_v1 * layer_shell;
 	struct zxdg_output_manager_v1 * output_manager;
+	struct wp_viewporter * viewporter;  // Optional
 
 	struct sockaddr_un ipc_sock;
 
+	// Threads which draw frames in the background. NULL if there aren't any,
+	// in which case everything happens on the main thread. How many there
+	// are is only read from the config at startup.
+	struct oguri_workers * workers;
+	int thread_count;  // Negative for one per CPU
+
+	// Draw the next frame while waiting for it, when the workers aren't.
+	bool render_ahead;
+
+	// Every animation's next frame. Those due within timer_slack of each
+	// other are shown together, on one wakeup.
+	struct oguri_timers * timers;
+	unsigned int timer_slack;  // Milliseconds
+
+	// Memory used by every output's buffers, and how much of it may be spent
+	// on cached frames.
+	size_t cache_memory;
+	size_t max_cache_memory;  // SIZE_MAX if unlimited
+
+	// Pools whose frame caches are gone, but which still have buffers the
+	// compositor hasn't released.
+	struct wl_list orphaned_pools;  // oguri_shm_pool::link
+
 	struct wl_list output_configs;  // oguri_output_config::link
 	struct wl_list idle_outputs;  // oguri_output::link
 	struct wl_list animations;  // oguri_animation::link
 };
 
 void oguri_reconfigure(struct oguri_state * oguri);
+bool oguri_add_event_source(struct oguri_state * oguri,
+		struct oguri_event_source * source, uint32_t events);
+bool oguri_modify_event_source(struct oguri_state * oguri,
+		struct oguri_event_source * source, uint32_t events);
+void oguri_remove_event_source(struct oguri_state * oguri,
+		struct oguri_event_source * source);
 
 #endif
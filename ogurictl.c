@@ -12,10 +12,15 @@
 
 static const char usage[] =
 	"Usage: ogurictl output NAME [<options>]\n"
+	"       ogurictl stats\n"
 	"       ogurictl [--help] [--version]\n"
 	"\n"
 	"Output options:\n"
 	"  --anchor        Sides to which the image should be anchored\n"
+	"  --compositor-scaling\n"
+	"                  Let the compositor scale the image (true or false)\n"
+	"  --compressed-cache\n"
+	"                  Compress cached frames to save memory (true or false)\n"
 	"  --filter        Scaling filter to apply to the image\n"
 	"  --image         Path to the image to show on this output\n"
 	"  --scaling-mode  Method used to fit the image to the output\n"
@@ -36,6 +41,8 @@ static const struct option general_options[] = {
 
 static struct option output_options[] = {
 	{"anchor", required_argument, 0, 0},
+	{"compositor-scaling", required_argument, 0, 0},
+	{"compressed-cache", required_argument, 0, 0},
 	{"filter", required_argument, 0, 0},
 	{"image", required_argument, 0, 0},
 	{"scaling-mode", required_argument, 0, 0},
@@ -92,6 +99,17 @@ int handle_output(int argc, char * argv[], char ** buffer, unsigned long * buffe
 }
 
 
+int handle_stats(int argc, char ** buffer, unsigned long * buffer_size) {
+	if (optind < argc) {
+		fprintf(stderr, "stats takes no arguments\n\n%s", usage);
+		return 1;
+	}
+
+	snprintf(*buffer, *buffer_size, "stats\n");
+	return 0;
+}
+
+
 int main(int argc, char * argv[]) {
 	int opt_char, opt_index = -1;
 	opt_char = getopt_long(argc, argv, "+hV", general_options, &opt_index);
@@ -121,6 +139,9 @@ int main(int argc, char * argv[]) {
 	if (strcmp(subcommand, "output") == 0) {
 		subcommand_return = handle_output(argc, argv, &buffer, &buffer_size);
 	}
+	else if (strcmp(subcommand, "stats") == 0) {
+		subcommand_return = handle_stats(argc, &buffer, &buffer_size);
+	}
 	else {
 		fprintf(stderr, "Unknown command '%s'\n\n%s", subcommand, usage);
 		free(buffer);
@@ -170,18 +191,18 @@ int main(int argc, char * argv[]) {
 		perror("Unable to send command to oguri");
 		goto close_err;
 	}
+	shutdown(sock_fd, SHUT_WR);  // Let oguri know that was everything.
 
-	int recv_len = recv(sock_fd, buffer, buffer_size - 1, 0);
-	if (recv_len < 0) {
-		perror("Unable to read response from oguri");
-		goto close_err;
-	}
-	else if (recv_len > 0) {
+	// oguri closes the connection once it has said everything it has to say,
+	// which might be nothing at all.
+	int recv_len;
+	while ((recv_len = recv(sock_fd, buffer, buffer_size - 1, 0)) > 0) {
 		buffer[recv_len] = '\0';
 		printf("%s", buffer);
 	}
-	else {
-		// oguri had nothing to say.
+	if (recv_len < 0) {
+		perror("Unable to read response from oguri");
+		goto close_err;
 	}
 
 	free(buffer);
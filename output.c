@@ -8,11 +8,12 @@
 #include <wayland-client.h>
 #include "wlr-layer-shell-unstable-v1-client-protocol.h"
 #include "xdg-output-unstable-v1-client-protocol.h"
+#include "viewporter-client-protocol.h"
 
 #include "oguri.h"
 #include "animation.h"
 #include "output.h"
-#include "buffers.h"
+#include "cache.h"
 
 static void noop() {}  // For unused listener members.
 
@@ -20,32 +21,27 @@ static void noop() {}  // For unused listener members.
 // Wayland outputs
 //
 
-static void oguri_recreate_buffers(struct oguri_output * output) {
-	if (!output->width || !output->height) {
-		// Probably in the middle of reconfiguring, will try again later.
-		return;
+// Works out what size the output's buffers need to be. Normally that's the
+// full resolution of the output, but when the compositor is doing the scaling
+// it's just the size of the image.
+static void get_buffer_size(
+		struct oguri_output * output, uint32_t * width, uint32_t * height) {
+	if (oguri_output_uses_viewport(output)) {
+		*width = cairo_image_surface_get_width(output->anim->source_surface);
+		*height = cairo_image_surface_get_height(output->anim->source_surface);
 	}
-
-	output->cached_frames = 0;
-
-	struct oguri_buffer * buffer, * tmp;
-	wl_list_for_each_safe(buffer, tmp, &output->buffer_ring, link) {
-		oguri_buffer_destroy(buffer);
+	else {
+		*width = output->width * output->scale;
+		*height = output->height * output->scale;
 	}
-	wl_list_init(&output->buffer_ring);
-
-	// If this is the first time we're being configured, we will have zero
-	// buffers. We always want to have at least two. If it isn't the first
-	// time, we need to reallocate as many as we already had because the
-	// animation loop won't do it for us if it has already finished the first
-	// cycle.
-
-	unsigned int count = (output->buffer_count) ? output->buffer_count : 2;
-	output->buffer_count = 0;
+}
 
-	if (!oguri_allocate_buffers(output, count)) {
-		fprintf(stderr, "Could not allocate buffers!\n");
-		output->oguri->run = false;
+// Called whenever something might have changed the size our buffers need to
+// be. The frame is drawn again at the new size, which is also when the output
+// is moved to a different frame cache if it needs one.
+static void handle_buffer_size_change(struct oguri_output * output) {
+	if (output->anim) {
+		oguri_animation_schedule_frame(output->anim, 1);
 	}
 }
 
@@ -61,7 +57,7 @@ static void handle_output_done(
 		void * data,
 		struct wl_output * wl_output __attribute__((unused))) {
 	struct oguri_output * output = data;
-	oguri_recreate_buffers(output);
+	handle_buffer_size_change(output);
 }
 
 struct wl_output_listener output_listener = {
@@ -95,7 +91,7 @@ static void layer_surface_configure(
 	wl_region_destroy(opaque);
 
 	zwlr_layer_surface_v1_ack_configure(layer_surface, serial);
-	oguri_recreate_buffers(output);
+	handle_buffer_size_change(output);
 }
 
 static void layer_surface_closed(
@@ -145,8 +141,8 @@ struct oguri_output * oguri_output_create(
 		struct oguri_state * oguri, struct wl_output * wl_output) {
 	struct oguri_output * output = calloc(1, sizeof(struct oguri_output));
 	output->oguri = oguri;
+	output->shown_frame = -1;
 	wl_list_init(&output->link);
-	wl_list_init(&output->buffer_ring);
 
 	output->output = wl_output;
 	wl_output_add_listener(wl_output, &output_listener, output);
@@ -222,6 +218,12 @@ void oguri_output_destroy(struct oguri_output * output) {
 
 	free(output->name);
 
+	if (output->frame_callback) {
+		wl_callback_destroy(output->frame_callback);
+	}
+	if (output->viewport) {
+		wp_viewport_destroy(output->viewport);
+	}
 	if (output->surface) {
 		wl_surface_destroy(output->surface);
 	}
@@ -229,11 +231,33 @@ void oguri_output_destroy(struct oguri_output * output) {
 		zwlr_layer_surface_v1_destroy(output->layer_surface);
 	}
 
-	struct oguri_buffer * buffer, * tmp;
-	wl_list_for_each_safe(buffer, tmp, &output->buffer_ring, link) {
-		oguri_buffer_destroy(buffer);
-	}
+	oguri_frame_cache_detach(output);
 
 	wl_output_destroy(output->output);
 	free(output);
 }
+
+bool oguri_output_uses_viewport(struct oguri_output * output) {
+	// Viewports can't repeat the image, so we always tile it ourselves.
+	return output->oguri->viewporter && output->anim && output->config &&
+		output->config->compositor_scaling &&
+		output->config->scaling_mode != SCALING_MODE_TILE;
+}
+
+// Works out the size of the output's buffers for its current animation and
+// configuration. Returns false if the output hasn't been configured yet.
+bool oguri_output_update_buffer_size(struct oguri_output * output) {
+	if (!output->width || !output->height) {
+		return false;
+	}
+	get_buffer_size(output, &output->buffer_width, &output->buffer_height);
+	return true;
+}
+
+void oguri_output_print_stats(struct oguri_output * output, FILE * stream) {
+	fprintf(stream, "output %s: %ux%u, %u frames skipped while waiting on "
+			"the compositor, %u while it caught up on reading\n",
+			output->name ? output->name : "(unnamed)",
+			output->buffer_width, output->buffer_height,
+			output->frames_throttled, output->frames_held);
+}
@@ -1,16 +1,23 @@
 #ifndef OGURI_OUTPUT_H
 #define OGURI_OUTPUT_H
 
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <wayland-client.h>
 #include <cairo.h>
 
 #include "config.h"
+#include "resample.h"
 
 struct oguri_state;
+struct oguri_animation;
+struct oguri_frame_cache;
 
 struct oguri_output {
 	struct oguri_state * oguri;
 	struct oguri_output_config * config;
+	struct oguri_animation * anim;  // NULL while idle
 	struct wl_list link;  // oguri_state::outputs
 
 	char * name;
@@ -18,18 +25,48 @@ struct oguri_output {
 
 	struct wl_surface * surface;
 	struct zwlr_layer_surface_v1 * layer_surface;
+	struct wp_viewport * viewport;  // Only while the compositor is scaling.
+
+	// What update_viewport last asked for, so that it only has to ask again
+	// when something changes. The buffer scale is 0 until it's first set, and
+	// the viewport's source and destination are -1 until they are.
+	int32_t buffer_scale;
+	wl_fixed_t viewport_source[4];  // x, y, width and height
+	int32_t viewport_width;
+	int32_t viewport_height;
 
 	uint32_t width;
 	uint32_t height;
 	int32_t scale;
 
-	unsigned int cached_frames;
-	struct wl_list buffer_ring;  // oguri_buffer::link
-	unsigned int buffer_count;
+	// The animation frame on screen, or -1 if we don't know for sure, and how
+	// it was scaled. Used to work out how much of the surface needs to be
+	// damaged, if any.
+	int shown_frame;
+	struct oguri_resample_params shown_params;
+
+	// Pending until the compositor is ready for another frame.
+	struct wl_callback * frame_callback;
+	unsigned int frames_throttled;
+
+	// Set when a frame was held back because the compositor hadn't read
+	// everything we'd already sent. See oguri_state::flush_blocked.
+	bool held;
+	unsigned int frames_held;
+
+	uint32_t buffer_width;
+	uint32_t buffer_height;
+
+	// Where its buffers come from, shared with any other outputs of the same
+	// animation which need exactly the same ones. NULL while idle.
+	struct oguri_frame_cache * cache;
 };
 
 struct oguri_output * oguri_output_create(
 		struct oguri_state * oguri, struct wl_output * wl_output);
 void oguri_output_destroy(struct oguri_output * output);
+bool oguri_output_uses_viewport(struct oguri_output * output);
+bool oguri_output_update_buffer_size(struct oguri_output * output);
+void oguri_output_print_stats(struct oguri_output * output, FILE * stream);
 
 #endif
@@ -0,0 +1,226 @@
+//
+// Animation probing
+//
+// gdk-pixbuf only lets on how many frames an animation has once it has shown
+// the last of them, which would mean a whole cycle of scaling every frame
+// before any of them could be cached. The common animated formats keep a
+// table of their frames which is cheap to walk without decoding anything, so
+// we read that ourselves instead.
+//
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "probe.h"
+
+static bool read_bytes(FILE * file, void * data, size_t length) {
+	return fread(data, 1, length, file) == length;
+}
+
+static uint32_t read_le16(const uint8_t * data) {
+	return data[0] | (uint32_t)data[1] << 8;
+}
+
+static uint32_t read_le24(const uint8_t * data) {
+	return read_le16(data) | (uint32_t)data[2] << 16;
+}
+
+static uint32_t read_le32(const uint8_t * data) {
+	return read_le24(data) | (uint32_t)data[3] << 24;
+}
+
+static bool add_frame(struct oguri_probe * probe, unsigned int delay) {
+	// The array doubles whenever the count reaches a power of two.
+	unsigned int count = probe->frame_count;
+	if (count == 0 || (count >= 16 && (count & (count - 1)) == 0)) {
+		unsigned int * delays = realloc(probe->delays,
+				(count ? count * 2 : 16) * sizeof(unsigned int));
+		if (!delays) {
+			return false;
+		}
+		probe->delays = delays;
+	}
+
+	probe->delays[probe->frame_count++] = delay;
+	return true;
+}
+
+//
+// GIF
+//
+
+// Skips a run of data sub-blocks, including the empty one on the end.
+static bool gif_skip_sub_blocks(FILE * file) {
+	int size;
+	while ((size = getc(file)) > 0) {
+		if (fseek(file, size, SEEK_CUR) != 0) {
+			return false;
+		}
+	}
+	return size == 0;
+}
+
+static bool gif_skip_color_table(FILE * file, uint8_t flags) {
+	if (!(flags & 0x80)) {
+		return true;
+	}
+	return fseek(file, 3 << ((flags & 0x07) + 1), SEEK_CUR) == 0;
+}
+
+// Every image descriptor is a frame, and takes its delay from the graphic
+// control extension before it, if any. The loop count lives in a NETSCAPE2.0
+// application extension. Without one, the animation only plays once.
+static bool probe_gif(FILE * file, struct oguri_probe * probe) {
+	uint8_t screen[7];  // Logical screen descriptor
+	if (!read_bytes(file, screen, sizeof(screen)) ||
+			!gif_skip_color_table(file, screen[4])) {
+		return false;
+	}
+
+	probe->loop_count = 1;
+	unsigned int delay = 0;
+	for (;;) {
+		int block = getc(file);
+		if (block == 0x3b) {  // Trailer
+			return probe->frame_count > 0;
+		}
+		else if (block == 0x2c) {  // Image descriptor
+			uint8_t descriptor[9];
+			if (!read_bytes(file, descriptor, sizeof(descriptor)) ||
+					!gif_skip_color_table(file, descriptor[8]) ||
+					getc(file) == EOF ||  // LZW minimum code size
+					!gif_skip_sub_blocks(file) ||
+					!add_frame(probe, delay)) {
+				return false;
+			}
+			delay = 0;
+		}
+		else if (block == 0x21) {  // Extension
+			int label = getc(file);
+			uint8_t data[255];
+			if (label == 0xf9) {  // Graphic control
+				if (getc(file) != 4 || !read_bytes(file, data, 4)) {
+					return false;
+				}
+				delay = read_le16(data + 1) * 10;
+			}
+			else if (label == 0xff) {  // Application
+				if (getc(file) != 11 || !read_bytes(file, data, 11)) {
+					return false;
+				}
+				bool netscape = memcmp(data, "NETSCAPE2.0", 11) == 0;
+
+				int size;
+				while ((size = getc(file)) > 0) {
+					if (!read_bytes(file, data, size)) {
+						return false;
+					}
+					if (netscape && size >= 3 && data[0] == 1) {
+						probe->loop_count = read_le16(data + 1);
+					}
+				}
+				if (size < 0) {
+					return false;
+				}
+				continue;
+			}
+			if (!gif_skip_sub_blocks(file)) {
+				return false;
+			}
+		}
+		else {
+			return false;  // Truncated, or not really a GIF.
+		}
+	}
+}
+
+//
+// WebP
+//
+
+// Animated WebPs have an ANIM chunk with the loop count, followed by an ANMF
+// chunk for each frame. Anything else is a still image.
+static bool probe_webp(FILE * file, struct oguri_probe * probe) {
+	uint8_t chunk[8];
+	while (read_bytes(file, chunk, sizeof(chunk))) {
+		uint32_t size = read_le32(chunk + 4);
+		long skip = (long)size + (size & 1);  // Chunks are padded to even.
+
+		if (memcmp(chunk, "ANIM", 4) == 0) {
+			uint8_t anim[6];
+			if (size < sizeof(anim) || !read_bytes(file, anim, sizeof(anim))) {
+				return false;
+			}
+			probe->loop_count = read_le16(anim + 4);
+			skip -= sizeof(anim);
+		}
+		else if (memcmp(chunk, "ANMF", 4) == 0) {
+			uint8_t frame[16];
+			if (size < sizeof(frame) ||
+					!read_bytes(file, frame, sizeof(frame)) ||
+					!add_frame(probe, read_le24(frame + 12))) {
+				return false;
+			}
+			skip -= sizeof(frame);
+		}
+
+		if (fseek(file, skip, SEEK_CUR) != 0) {
+			return false;
+		}
+	}
+
+	if (probe->frame_count == 0) {
+		return add_frame(probe, 0);
+	}
+	return true;
+}
+
+//
+// Probing
+//
+
+// Reads the frame table of a GIF, WebP or PNG image. Returns false for
+// anything else, or if the file doesn't make sense, in which case the frames
+// will have to be counted as they are shown.
+bool oguri_probe_image(const char * path, struct oguri_probe * probe) {
+	static const uint8_t png_signature[8] = {
+		0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n',
+	};
+
+	*probe = (struct oguri_probe) {0};
+	FILE * file = fopen(path, "rb");
+	if (!file) {
+		return false;
+	}
+
+	bool probed = false;
+	uint8_t magic[12];
+	if (read_bytes(file, magic, sizeof(magic))) {
+		if (memcmp(magic, "GIF87a", 6) == 0 ||
+				memcmp(magic, "GIF89a", 6) == 0) {
+			probed = fseek(file, 6, SEEK_SET) == 0 && probe_gif(file, probe);
+		}
+		else if (memcmp(magic, "RIFF", 4) == 0 &&
+				memcmp(magic + 8, "WEBP", 4) == 0) {
+			probed = probe_webp(file, probe);
+		}
+		else if (memcmp(magic, png_signature, sizeof(png_signature)) == 0) {
+			// gdk-pixbuf doesn't animate APNGs, it just shows their default
+			// image, so that's the only frame as far as we're concerned.
+			probed = add_frame(probe, 0);
+		}
+	}
+
+	fclose(file);
+	if (!probed) {
+		oguri_probe_finish(probe);
+	}
+	return probed;
+}
+
+void oguri_probe_finish(struct oguri_probe * probe) {
+	free(probe->delays);
+	*probe = (struct oguri_probe) {0};
+}
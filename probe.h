@@ -0,0 +1,17 @@
+#ifndef OGURI_PROBE_H
+#define OGURI_PROBE_H
+
+#include <stdbool.h>
+
+// What the image file itself says about its animation, before gdk-pixbuf has
+// decoded any of it.
+struct oguri_probe {
+	unsigned int frame_count;
+	unsigned int * delays;  // Milliseconds, one per frame.
+	unsigned int loop_count;  // 0 if it loops forever.
+};
+
+bool oguri_probe_image(const char * path, struct oguri_probe * probe);
+void oguri_probe_finish(struct oguri_probe * probe);
+
+#endif
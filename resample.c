@@ -0,0 +1,919 @@
+//
+// Separable image resampling
+//
+// Cairo's image backend handles arbitrary transforms, which makes it slow for
+// the only thing we ever ask of it: an axis-aligned scale. Since the mapping
+// from buffer to image never changes between frames, we can instead work out
+// every filter tap once, and then each frame is just two passes of
+// fixed-point multiply-adds (horizontally into intermediate rows, then
+// vertically into the buffer).
+//
+// The filters are modelled on what cairo asks pixman for, so that switching
+// between this and cairo_paint doesn't visibly change anything.
+//
+#define _POSIX_C_SOURCE 200809L
+
+#include <limits.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "resample.h"
+#include "workers.h"
+
+// Taps have 14 fractional bits. That leaves room for pmaddwd to add two of
+// them multiplied by an intermediate value without overflowing 32 bits.
+#define WEIGHT_BITS 14
+#define WEIGHT_ONE (1 << WEIGHT_BITS)
+
+// Intermediate rows keep this many extra bits after the horizontal pass.
+#define INTERMEDIATE_BITS 6
+#define HORIZONTAL_SHIFT (WEIGHT_BITS - INTERMEDIATE_BITS)
+#define VERTICAL_SHIFT (WEIGHT_BITS + INTERMEDIATE_BITS)
+
+// Splitting a frame between threads is only worth it for bands at least this
+// many target pixels in size.
+#define MIN_BAND_PIXELS (256 * 1024)
+
+enum resample_kernel {
+	KERNEL_NEAREST,
+	KERNEL_BILINEAR,
+	KERNEL_BOX,
+	KERNEL_CATMULL_ROM,
+};
+
+struct resample_axis {
+	int length;
+	int taps;  // Per target pixel, unused ones have a weight of zero.
+
+	int * start;  // Unwrapped source position of the first tap, per pixel.
+	int * index;  // length * taps source positions, -1 if outside the image.
+	int16_t * weight;  // length * taps
+};
+
+// Working space for the convolution, one for each band of the target that
+// can be resampled at the same time (see oguri_resampler_run_many).
+struct resample_rows {
+	// Source rows after the horizontal pass. Slots are keyed by unwrapped
+	// position, so the rows needed for one target row never collide even when
+	// tiling wraps around the bottom of the image.
+	int16_t * rows;
+	int * keys;
+
+	// Scratch space for gathering the rows needed by one target row.
+	const int16_t ** tap_rows;
+	int16_t * tap_weights;
+};
+
+struct oguri_resampler {
+	struct oguri_resample_params params;
+
+	struct resample_axis x;
+	struct resample_axis y;
+	bool nearest;  // One tap per axis, see run_nearest.
+
+	// When tiling, the target repeats every tile_width by tile_height pixels,
+	// so only that much needs resampling and the rest is copied. Zero if the
+	// image doesn't repeat within the target along that axis.
+	int tile_width;
+	int tile_height;
+
+	int row_length;  // int16 values per row, rounded up to fill a vector.
+	struct resample_rows * bands;
+	int band_count;
+};
+
+//
+// Filter kernels
+//
+
+// These take the distance from the sample point in source pixels, and the
+// size of a target pixel in source pixels (above 1 when scaling down).
+
+// A box the size of a target pixel, convolved with a source pixel.
+static double box_kernel(double x, double r) {
+	return fmax(0.0, fmin(fmin(r, 1.0),
+				fmin((r + 1) / 2 - x, (r + 1) / 2 + x)));
+}
+
+static double cubic_kernel(double x, double r, double b, double c) {
+	if (r < 1.0) {
+		return cubic_kernel(x * 2 - 0.5, r * 2, b, c) +
+			cubic_kernel(x * 2 + 0.5, r * 2, b, c);
+	}
+
+	double ax = fabs(x / r);
+	if (ax < 1) {
+		return (((12 - 9 * b - 6 * c) * ax +
+					(-18 + 12 * b + 6 * c)) * ax * ax +
+				(6 - 2 * b)) / 6;
+	}
+	else if (ax < 2) {
+		return ((((-b - 6 * c) * ax +
+						(6 * b + 30 * c)) * ax +
+					(-12 * b - 48 * c)) * ax +
+				(8 * b + 24 * c)) / 6;
+	}
+	return 0.0;
+}
+
+static double catmull_rom_kernel(double x, double r) {
+	return cubic_kernel(x, r, 0.0, 0.5);
+}
+
+// Sizes the kernel along one axis the way cairo does for this filter. Which
+// kernel that is has already been settled for both axes, see choose_filter.
+static void size_kernel(cairo_filter_t filter, double * r) {
+	switch (filter) {
+	case CAIRO_FILTER_GOOD:
+		// An axis scaled down by no more than 0.75 only gets a pixel's worth.
+		*r = (*r < 1.0 / 0.75) ? 1.0 : fmin(*r, 16.0);
+		break;
+	case CAIRO_FILTER_BEST:
+		// Blur up to 2x, then blend towards square pixels when scaling up.
+		if (*r > 16.0) {
+			*r = 16.0;
+		}
+		else if (*r < 1.0 / 128) {
+			*r = 1.0 / 127;
+		}
+		else if (*r < 0.5) {
+			*r = 1.0 / (1.0 / *r - 1.0);
+		}
+		else if (*r < 1.0) {
+			*r = 1.0;
+		}
+		break;
+	default:
+		break;  // Nearest and bilinear don't have a size.
+	}
+}
+
+static int kernel_taps(enum resample_kernel kernel, double r) {
+	switch (kernel) {
+	case KERNEL_NEAREST:
+		return 1;
+	case KERNEL_BILINEAR:
+		return 2;
+	case KERNEL_BOX:
+		return (r < 1.0) ? 2 : (int)ceil(r + 1);
+	case KERNEL_CATMULL_ROM:
+		return (r * 4 > 2) ? (int)ceil(r * 4) : 2;
+	}
+	return 1;
+}
+
+//
+// Tap tables
+//
+
+static void destroy_axis(struct resample_axis * axis) {
+	free(axis->start);
+	free(axis->index);
+	free(axis->weight);
+}
+
+static bool build_axis(
+		struct resample_axis * axis,
+		int source_length,
+		int length,
+		double scale,
+		double offset,
+		enum resample_kernel kernel,
+		cairo_filter_t filter,
+		bool repeat,
+		int period) {
+	double r = 1.0 / scale;  // Size of a target pixel in source pixels.
+	size_kernel(filter, &r);
+	int taps = kernel_taps(kernel, r);
+
+	// Like pixman, snap the sample point to one of a fixed number of phases
+	// between source pixels for the convolution kernels.
+	int phases = 1;
+	while (r * phases <= 128.0) {
+		phases *= 2;
+	}
+
+	axis->length = length;
+	axis->taps = taps;
+	axis->start = calloc(length, sizeof(int));
+	axis->index = calloc((size_t)length * taps, sizeof(int));
+	axis->weight = calloc((size_t)length * taps, sizeof(int16_t));
+	double * coefficients = calloc(taps, sizeof(double));
+	if (!axis->start || !axis->index || !axis->weight || !coefficients) {
+		free(coefficients);
+		destroy_axis(axis);
+		return false;
+	}
+
+	for (int i = 0; i < length; ++i) {
+		int16_t * weight = axis->weight + (size_t)i * taps;
+		int * index = axis->index + (size_t)i * taps;
+
+		// When tiling, every period of the target gets exactly the same taps
+		// as the first one, rather than whatever rounding errors give us.
+		if (period && i >= period) {
+			memcpy(weight, weight - (size_t)period * taps,
+					taps * sizeof(int16_t));
+			memcpy(index, index - (size_t)period * taps, taps * sizeof(int));
+			axis->start[i] = axis->start[i - period] + source_length;
+			continue;
+		}
+
+		double u = (i + 0.5) / scale - offset;
+		int first = 0;
+
+		switch (kernel) {
+		case KERNEL_NEAREST:
+			first = (int)floor(u - 1.0 / 65536);
+			weight[0] = WEIGHT_ONE;
+			break;
+		case KERNEL_BILINEAR: {
+			// Pixman only keeps 7 bits of the distance between pixels.
+			double t = u - 0.5;
+			first = (int)floor(t);
+			int fraction = (int)((t - first) * 128);
+			weight[0] = (128 - fraction) << (WEIGHT_BITS - 7);
+			weight[1] = fraction << (WEIGHT_BITS - 7);
+			break;
+		}
+		case KERNEL_BOX:
+		case KERNEL_CATMULL_ROM: {
+			double x = (floor(u * phases) + 0.5) / phases;
+			first = (int)floor(x - 1.0 / 65536 - (taps - 1) / 2.0);
+
+			double total = 0.0;
+			for (int t = 0; t < taps; ++t) {
+				double distance = first + t + 0.5 - x;
+				coefficients[t] = (kernel == KERNEL_BOX) ?
+					box_kernel(distance, r) :
+					catmull_rom_kernel(distance, r);
+				total += coefficients[t];
+			}
+
+			// Make sure the rounded taps still add up to exactly one.
+			int sum = 0;
+			for (int t = 0; t < taps; ++t) {
+				weight[t] = (int16_t)lround(coefficients[t] / total * WEIGHT_ONE);
+				sum += weight[t];
+			}
+			weight[taps / 2] += WEIGHT_ONE - sum;
+			break;
+		}
+		}
+
+		axis->start[i] = first;
+		for (int t = 0; t < taps; ++t) {
+			int position = first + t;
+			if (repeat) {
+				position %= source_length;
+				if (position < 0) {
+					position += source_length;
+				}
+			}
+			else if (position < 0 || position >= source_length) {
+				position = -1;
+			}
+			index[t] = position;
+		}
+	}
+
+	free(coefficients);
+	return true;
+}
+
+//
+// Passes
+//
+
+static void resample_row(
+		const struct resample_axis * axis,
+		int length,
+		const uint8_t * source,
+		int16_t * restrict out) {
+	const int round = 1 << (HORIZONTAL_SHIFT - 1);
+	const int taps = axis->taps;
+	const int * restrict index = axis->index;
+	const int16_t * restrict weight = axis->weight;
+
+#ifdef __SSE2__
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i rounding = _mm_set1_epi32(round);
+#endif
+
+	for (int i = 0; i < length; ++i, index += taps, weight += taps) {
+#ifdef __SSE2__
+		// Interleave two pixels' channels so that pmaddwd can apply both of
+		// their taps at once.
+		__m128i acc = zero;
+		int t = 0;
+		for (; t < taps; t += 2) {
+			int32_t a, b = 0;
+			uint32_t pair = (uint16_t)weight[t];
+			memcpy(&a, source + 4 * index[t], sizeof(a));
+			if (t + 1 < taps) {
+				memcpy(&b, source + 4 * index[t + 1], sizeof(b));
+				pair |= (uint32_t)(uint16_t)weight[t + 1] << 16;
+			}
+			__m128i px = _mm_unpacklo_epi16(
+					_mm_unpacklo_epi8(_mm_cvtsi32_si128(a), zero),
+					_mm_unpacklo_epi8(_mm_cvtsi32_si128(b), zero));
+			acc = _mm_add_epi32(acc,
+					_mm_madd_epi16(px, _mm_set1_epi32((int32_t)pair)));
+		}
+		acc = _mm_srai_epi32(_mm_add_epi32(acc, rounding), HORIZONTAL_SHIFT);
+		_mm_storel_epi64((__m128i *)(out + 4 * i), _mm_packs_epi32(acc, acc));
+#else
+		int32_t acc[4] = {0};
+		for (int t = 0; t < taps; ++t) {
+			const uint8_t * px = source + 4 * index[t];
+			for (int c = 0; c < 4; ++c) {
+				acc[c] += px[c] * weight[t];
+			}
+		}
+		for (int c = 0; c < 4; ++c) {
+			out[4 * i + c] = (int16_t)((acc[c] + round) >> HORIZONTAL_SHIFT);
+		}
+#endif
+	}
+}
+
+static inline uint8_t clamp_channel(int32_t value) {
+	return (value < 0) ? 0 : (value > 0xff) ? 0xff : (uint8_t)value;
+}
+
+static void resample_column(
+		const int16_t * const * rows,
+		const int16_t * weights,
+		int count,
+		int values,
+		uint8_t * restrict out) {
+	const int32_t round = 1 << (VERTICAL_SHIFT - 1);
+	int v = 0;
+
+#ifdef __SSE2__
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i rounding = _mm_set1_epi32(round);
+
+	// Taps are applied two rows at a time, so pair them up (with a zero row
+	// if there's an odd one out) before going across the row.
+	int pairs = (count + 1) / 2;
+	const int16_t * first[pairs + 1];
+	const int16_t * second[pairs + 1];
+	__m128i pair_weights[pairs + 1];
+	for (int p = 0; p < pairs; ++p) {
+		int t = 2 * p;
+		uint32_t pair = (uint16_t)weights[t];
+		first[p] = rows[t];
+		second[p] = rows[t];
+		if (t + 1 < count) {
+			second[p] = rows[t + 1];
+			pair |= (uint32_t)(uint16_t)weights[t + 1] << 16;
+		}
+		pair_weights[p] = _mm_set1_epi32((int32_t)pair);
+	}
+
+	// Two pixels at a time.
+	for (; v + 8 <= values; v += 8) {
+		__m128i acc_lo = zero;
+		__m128i acc_hi = zero;
+		for (int p = 0; p < pairs; ++p) {
+			__m128i a = _mm_loadu_si128((const __m128i *)(first[p] + v));
+			__m128i b = _mm_loadu_si128((const __m128i *)(second[p] + v));
+			acc_lo = _mm_add_epi32(acc_lo,
+					_mm_madd_epi16(_mm_unpacklo_epi16(a, b), pair_weights[p]));
+			acc_hi = _mm_add_epi32(acc_hi,
+					_mm_madd_epi16(_mm_unpackhi_epi16(a, b), pair_weights[p]));
+		}
+		acc_lo = _mm_srai_epi32(_mm_add_epi32(acc_lo, rounding), VERTICAL_SHIFT);
+		acc_hi = _mm_srai_epi32(_mm_add_epi32(acc_hi, rounding), VERTICAL_SHIFT);
+		__m128i packed = _mm_packs_epi32(acc_lo, acc_hi);
+		_mm_storel_epi64((__m128i *)(out + v), _mm_packus_epi16(packed, packed));
+	}
+#endif
+
+	for (; v < values; ++v) {
+		int32_t acc = 0;
+		for (int t = 0; t < count; ++t) {
+			acc += rows[t][v] * weights[t];
+		}
+		out[v] = clamp_channel((acc + round) >> VERTICAL_SHIFT);
+	}
+}
+
+// With a single tap there's nothing to blend, so a row is just a widened copy
+// of one source row.
+static void widen_row(
+		const struct resample_axis * axis,
+		int length,
+		const uint8_t * source,
+		uint8_t * restrict out) {
+	const int * restrict index = axis->index;
+	const int16_t * restrict weight = axis->weight;
+
+	for (int i = 0; i < length; ++i) {
+		uint32_t pixel = 0;  // Transparent outside of the image.
+		if (weight[i]) {
+			memcpy(&pixel, source + 4 * index[i], sizeof(pixel));
+		}
+		memcpy(out + 4 * i, &pixel, sizeof(pixel));
+	}
+}
+
+// Nearest neighbour scaling, which is what pixel art wants. Consecutive target
+// rows that come from the same source row are copied rather than widened
+// again, so scaling up by a whole factor of N only widens one row in N. Rows
+// above top belong to another thread, so those can't be copied.
+static void nearest_row(
+		const struct oguri_resampler * resampler,
+		int width,
+		int y,
+		int top,
+		const uint8_t * source_pixels,
+		int source_stride,
+		uint8_t * target_pixels,
+		int target_stride) {
+	const int * index = resampler->y.index;
+	size_t row_bytes = (size_t)width * 4;
+	uint8_t * out = target_pixels + (size_t)y * target_stride;
+
+	if (y > top && index[y] == index[y - 1]) {
+		memcpy(out, out - target_stride, row_bytes);
+	}
+	else if (index[y] < 0) {
+		memset(out, 0, row_bytes);
+	}
+	else {
+		widen_row(&resampler->x, width,
+				source_pixels + (size_t)index[y] * source_stride, out);
+	}
+}
+
+static void convolution_row(
+		const struct oguri_resampler * resampler,
+		struct resample_rows * band,
+		int width,
+		int y,
+		const uint8_t * source_pixels,
+		int source_stride,
+		uint8_t * target_pixels,
+		int target_stride) {
+	const struct resample_axis * y_axis = &resampler->y;
+	int slots = y_axis->taps;
+	const int * index = y_axis->index + (size_t)y * slots;
+	const int16_t * weight = y_axis->weight + (size_t)y * slots;
+
+	int count = 0;
+	for (int t = 0; t < slots; ++t) {
+		if (index[t] < 0 || weight[t] == 0) {
+			continue;
+		}
+
+		int key = y_axis->start[y] + t;
+		int slot = key % slots;
+		if (slot < 0) {
+			slot += slots;
+		}
+
+		int16_t * row = band->rows + (size_t)slot * resampler->row_length;
+		if (band->keys[slot] != key) {
+			resample_row(&resampler->x, width,
+					source_pixels + (size_t)index[t] * source_stride, row);
+			band->keys[slot] = key;
+		}
+
+		band->tap_rows[count] = row;
+		band->tap_weights[count] = weight[t];
+		++count;
+	}
+
+	resample_column(band->tap_rows, band->tap_weights, count,
+			width * 4, target_pixels + (size_t)y * target_stride);
+}
+
+// Fills the rest of the target from its top left tile. Both directions double
+// the area copied each time, so this is only a handful of large memcpys.
+static void fill_tiles(
+		int tile_width,
+		int tile_height,
+		int width,
+		int height,
+		uint8_t * target_pixels,
+		int target_stride) {
+	for (int y = 0; y < tile_height; ++y) {
+		uint8_t * row = target_pixels + (size_t)y * target_stride;
+		for (int filled = tile_width; filled < width;) {
+			int count = (filled < width - filled) ? filled : width - filled;
+			memcpy(row + (size_t)filled * 4, row, (size_t)count * 4);
+			filled += count;
+		}
+	}
+
+	for (int filled = tile_height; filled < height;) {
+		int count = (filled < height - filled) ? filled : height - filled;
+		memcpy(target_pixels + (size_t)filled * target_stride, target_pixels,
+				(size_t)(count - 1) * target_stride + (size_t)width * 4);
+		filled += count;
+	}
+}
+
+//
+// Resamplers
+//
+
+static void destroy_band(struct resample_rows * band) {
+	free(band->rows);
+	free(band->keys);
+	free(band->tap_rows);
+	free(band->tap_weights);
+}
+
+// Makes room for another band to be resampled alongside the others.
+static bool add_band(struct oguri_resampler * resampler) {
+	struct resample_rows * bands = realloc(resampler->bands,
+			(resampler->band_count + 1) * sizeof(struct resample_rows));
+	if (!bands) {
+		return false;
+	}
+	resampler->bands = bands;
+
+	int slots = resampler->y.taps;
+	struct resample_rows * band = &bands[resampler->band_count];
+	*band = (struct resample_rows) {
+		.rows = calloc((size_t)slots * resampler->row_length, sizeof(int16_t)),
+		.keys = calloc(slots, sizeof(int)),
+		.tap_rows = calloc(slots, sizeof(int16_t *)),
+		.tap_weights = calloc(slots, sizeof(int16_t)),
+	};
+	if (!band->rows || !band->keys || !band->tap_rows || !band->tap_weights) {
+		destroy_band(band);
+		return false;
+	}
+	++resampler->band_count;
+	return true;
+}
+
+// Cairo skips filtering entirely when pixels line up one to one.
+static bool is_pixel_exact(const struct oguri_resample_params * params) {
+	return params->scale_x == 1.0 && params->scale_y == 1.0 &&
+		params->offset_x == floor(params->offset_x) &&
+		params->offset_y == floor(params->offset_y);
+}
+
+// Whether cairo would settle for bilinear along an axis with the good filter:
+// when it's scaled down by no more than 0.75, or exactly halved with the
+// pixels lined up.
+static bool is_bilinear_enough(double scale, double offset) {
+	double r = 1.0 / scale;
+	if (r < 1.0 / 0.75) {
+		return true;
+	}
+	return r > 1.9975 && r < 2.0025 && offset == floor(offset);
+}
+
+// Picks the kernel for both axes, since cairo hands pixman a single one. It
+// only swaps the good filter for bilinear if it can for both axes, and
+// otherwise uses a box for both. The best filter is a box on both as soon as
+// either is scaled down by more than 16.
+static enum resample_kernel choose_filter(
+		const struct oguri_resample_params * params) {
+	if (is_pixel_exact(params)) {
+		return KERNEL_NEAREST;
+	}
+
+	switch (params->filter) {
+	case CAIRO_FILTER_FAST:
+	case CAIRO_FILTER_NEAREST:
+		return KERNEL_NEAREST;
+	case CAIRO_FILTER_GOOD:
+		if (is_bilinear_enough(params->scale_x, params->offset_x) &&
+				is_bilinear_enough(params->scale_y, params->offset_y)) {
+			return KERNEL_BILINEAR;
+		}
+		return KERNEL_BOX;
+	case CAIRO_FILTER_BEST:
+		if (1.0 / params->scale_x > 16.0 || 1.0 / params->scale_y > 16.0) {
+			return KERNEL_BOX;
+		}
+		return KERNEL_CATMULL_ROM;
+	case CAIRO_FILTER_BILINEAR:
+	default:
+		return KERNEL_BILINEAR;
+	}
+}
+
+struct oguri_resampler * oguri_resampler_create(
+		const struct oguri_resample_params * params) {
+	if (params->source_width < 1 || params->source_height < 1 ||
+			params->target_width < 1 || params->target_height < 1) {
+		return NULL;
+	}
+
+	struct oguri_resampler * resampler = calloc(
+			1, sizeof(struct oguri_resampler));
+	if (!resampler) {
+		return NULL;
+	}
+	resampler->params = *params;
+
+	// A tiled image repeats after a whole number of target pixels whenever the
+	// scaled size of the image is a whole number, which it always is for the
+	// integer output scales that tile mode uses.
+	if (params->repeat) {
+		double tile_width = params->source_width * params->scale_x;
+		double tile_height = params->source_height * params->scale_y;
+		if (tile_width == floor(tile_width) &&
+				tile_width < params->target_width) {
+			resampler->tile_width = (int)tile_width;
+		}
+		if (tile_height == floor(tile_height) &&
+				tile_height < params->target_height) {
+			resampler->tile_height = (int)tile_height;
+		}
+	}
+
+	enum resample_kernel kernel = choose_filter(params);
+
+	if (!build_axis(&resampler->x, params->source_width,
+				params->target_width, params->scale_x, params->offset_x,
+				kernel, params->filter, params->repeat,
+				resampler->tile_width)) {
+		free(resampler);
+		return NULL;
+	}
+	if (!build_axis(&resampler->y, params->source_height,
+				params->target_height, params->scale_y, params->offset_y,
+				kernel, params->filter, params->repeat,
+				resampler->tile_height)) {
+		destroy_axis(&resampler->x);
+		free(resampler);
+		return NULL;
+	}
+
+	// Horizontal taps outside of the image are transparent, so point them at
+	// any valid pixel and let the zero weight take care of it. Vertical ones
+	// are skipped instead, since that saves a whole row.
+	size_t x_taps = (size_t)resampler->x.length * resampler->x.taps;
+	for (size_t i = 0; i < x_taps; ++i) {
+		if (resampler->x.index[i] < 0) {
+			resampler->x.index[i] = 0;
+			resampler->x.weight[i] = 0;
+		}
+	}
+
+	// Nearest scaling doesn't need any intermediate rows.
+	resampler->nearest = resampler->x.taps == 1 && resampler->y.taps == 1;
+	if (resampler->nearest) {
+		return resampler;
+	}
+
+	resampler->row_length = (params->target_width * 4 + 7) & ~7;
+	if (!add_band(resampler)) {
+		oguri_resampler_destroy(resampler);
+		return NULL;
+	}
+
+	return resampler;
+}
+
+bool oguri_resample_params_equal(
+		const struct oguri_resample_params * a,
+		const struct oguri_resample_params * b) {
+	return a->source_width == b->source_width &&
+		a->source_height == b->source_height &&
+		a->target_width == b->target_width &&
+		a->target_height == b->target_height &&
+		a->scale_x == b->scale_x &&
+		a->scale_y == b->scale_y &&
+		a->offset_x == b->offset_x &&
+		a->offset_y == b->offset_y &&
+		a->filter == b->filter &&
+		a->repeat == b->repeat;
+}
+
+bool oguri_resampler_matches(
+		const struct oguri_resampler * resampler,
+		const struct oguri_resample_params * params) {
+	return oguri_resample_params_equal(&resampler->params, params);
+}
+
+void oguri_resampler_run(
+		struct oguri_resampler * resampler,
+		cairo_surface_t * source,
+		cairo_surface_t * target) {
+	oguri_resampler_run_many(&resampler, &target, 1, source, NULL);
+}
+
+// The rows of one target that a band fills in.
+struct resample_target {
+	struct oguri_resampler * resampler;
+	uint8_t * pixels;
+	int stride;
+	int width;  // Of the part that is resampled, the rest is tiled.
+	int top;
+	int bottom;  // One past the last row.
+	int y;  // Next row to resample.
+};
+
+// One band of every target, filled in by a single thread.
+struct resample_band {
+	struct oguri_job job;  // First, so that run_band can get back here.
+	struct resample_target * targets;
+	int count;
+	int index;  // Which of each resampler's bands of intermediate rows to use.
+	const uint8_t * source_pixels;
+	int source_stride;
+};
+
+// The furthest source row (unwrapped, like resample_axis::start) that the
+// target's next row reads from.
+static int last_source_row(const struct resample_target * target) {
+	const struct resample_axis * y_axis = &target->resampler->y;
+	return y_axis->start[target->y] + y_axis->taps - 1;
+}
+
+// Rather than streaming the whole source through the cache once per target,
+// the targets move down the source together: each round, every target
+// produces all of the rows it can from the source rows read so far, so a
+// source row is read by all of them while it's still in cache.
+static void resample_band(struct resample_band * band) {
+	for (int i = 0; i < band->count; ++i) {
+		// The source changes every frame, so nothing from last time is
+		// reusable.
+		struct oguri_resampler * resampler = band->targets[i].resampler;
+		if (!resampler->nearest) {
+			int * keys = resampler->bands[band->index].keys;
+			for (int slot = 0; slot < resampler->y.taps; ++slot) {
+				keys[slot] = INT_MIN;
+			}
+		}
+	}
+
+	for (;;) {
+		int cursor = INT_MAX;
+		for (int i = 0; i < band->count; ++i) {
+			struct resample_target * target = &band->targets[i];
+			if (target->y < target->bottom &&
+					last_source_row(target) < cursor) {
+				cursor = last_source_row(target);
+			}
+		}
+		if (cursor == INT_MAX) {
+			break;
+		}
+
+		for (int i = 0; i < band->count; ++i) {
+			struct resample_target * target = &band->targets[i];
+			struct oguri_resampler * resampler = target->resampler;
+			for (; target->y < target->bottom &&
+					last_source_row(target) <= cursor; ++target->y) {
+				if (resampler->nearest) {
+					nearest_row(resampler, target->width, target->y,
+							target->top, band->source_pixels,
+							band->source_stride,
+							target->pixels, target->stride);
+				}
+				else {
+					convolution_row(resampler,
+							&resampler->bands[band->index],
+							target->width, target->y,
+							band->source_pixels, band->source_stride,
+							target->pixels, target->stride);
+				}
+			}
+		}
+	}
+}
+
+static void run_band(struct oguri_job * job) {
+	resample_band((struct resample_band *)job);
+}
+
+// How many bands to split the targets into: one per thread, so long as each
+// band still has plenty to do.
+static int get_band_count(struct oguri_resampler ** resamplers, int count,
+		struct oguri_workers * workers) {
+	if (!workers) {
+		return 1;
+	}
+
+	size_t pixels = 0;
+	for (int i = 0; i < count; ++i) {
+		const struct oguri_resampler * resampler = resamplers[i];
+		pixels += (size_t)(resampler->tile_width ?
+				resampler->tile_width : resampler->x.length) *
+			(resampler->tile_height ?
+				resampler->tile_height : resampler->y.length);
+	}
+	size_t band_count = pixels / MIN_BAND_PIXELS;
+	if (band_count > oguri_workers_get_count(workers)) {
+		band_count = oguri_workers_get_count(workers);
+	}
+	if (band_count < 2) {
+		return 1;
+	}
+
+	// Each band needs its own intermediate rows. If there isn't room for
+	// them, fewer bands will have to do.
+	for (int i = 0; i < count; ++i) {
+		struct oguri_resampler * resampler = resamplers[i];
+		while (!resampler->nearest &&
+				(size_t)resampler->band_count < band_count) {
+			if (!add_band(resampler)) {
+				band_count = resampler->band_count;
+			}
+		}
+	}
+	return band_count;
+}
+
+// Scales one source into several targets at once. Large targets are split
+// into horizontal bands, which are resampled on as many of the workers as
+// there are bands, if there are any workers.
+void oguri_resampler_run_many(
+		struct oguri_resampler ** resamplers,
+		cairo_surface_t ** targets,
+		int count,
+		cairo_surface_t * source,
+		struct oguri_workers * workers) {
+	if (count < 1) {
+		return;
+	}
+
+	cairo_surface_flush(source);
+	const uint8_t * source_pixels = cairo_image_surface_get_data(source);
+	int source_stride = cairo_image_surface_get_stride(source);
+
+	int band_count = get_band_count(resamplers, count, workers);
+	struct resample_target parts[band_count][count];
+	for (int i = 0; i < count; ++i) {
+		struct oguri_resampler * resampler = resamplers[i];
+		cairo_surface_flush(targets[i]);
+		int height = resampler->tile_height ?
+			resampler->tile_height : resampler->y.length;
+		for (int b = 0; b < band_count; ++b) {
+			parts[b][i] = (struct resample_target) {
+				.resampler = resampler,
+				.pixels = cairo_image_surface_get_data(targets[i]),
+				.stride = cairo_image_surface_get_stride(targets[i]),
+				.width = resampler->tile_width ?
+					resampler->tile_width : resampler->x.length,
+				.top = height * b / band_count,
+				.bottom = height * (b + 1) / band_count,
+			};
+			parts[b][i].y = parts[b][i].top;
+		}
+	}
+
+	struct resample_band bands[band_count];
+	struct oguri_job * jobs[band_count];
+	for (int b = 0; b < band_count; ++b) {
+		bands[b] = (struct resample_band) {
+			.job.run = run_band,
+			.targets = parts[b],
+			.count = count,
+			.index = b,
+			.source_pixels = source_pixels,
+			.source_stride = source_stride,
+		};
+		jobs[b] = &bands[b].job;
+	}
+	if (band_count > 1) {
+		oguri_workers_run(workers, jobs, band_count);
+	}
+	else {
+		resample_band(&bands[0]);
+	}
+
+	for (int i = 0; i < count; ++i) {
+		const struct resample_target * target = &parts[0][i];
+		const struct oguri_resampler * resampler = target->resampler;
+		int height = resampler->tile_height ?
+			resampler->tile_height : resampler->y.length;
+		if (target->width < resampler->x.length ||
+				height < resampler->y.length) {
+			fill_tiles(target->width, height,
+					resampler->x.length, resampler->y.length,
+					target->pixels, target->stride);
+		}
+		cairo_surface_mark_dirty(targets[i]);
+	}
+}
+
+void oguri_resampler_destroy(struct oguri_resampler * resampler) {
+	if (!resampler) {
+		return;
+	}
+
+	destroy_axis(&resampler->x);
+	destroy_axis(&resampler->y);
+	for (int i = 0; i < resampler->band_count; ++i) {
+		destroy_band(&resampler->bands[i]);
+	}
+	free(resampler->bands);
+	free(resampler);
+}
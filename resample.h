@@ -0,0 +1,53 @@
+#ifndef OGURI_RESAMPLE_H
+#define OGURI_RESAMPLE_H
+
+#include <stdbool.h>
+#include <cairo.h>
+
+// Describes how a source image maps onto a target buffer. A target pixel at
+// (x, y) samples the source around ((x + 0.5) / scale_x - offset_x,
+// (y + 0.5) / scale_y - offset_y), which is the same transform that
+// scale_image_with_cairo hands to cairo as a pattern matrix.
+//
+// This is also what decides whether a resampler can be reused, see
+// oguri_resampler_matches.
+struct oguri_resample_params {
+	int source_width;
+	int source_height;
+	int target_width;
+	int target_height;
+
+	double scale_x;
+	double scale_y;
+	double offset_x;
+	double offset_y;
+
+	cairo_filter_t filter;
+	bool repeat;  // Tile the source, otherwise it is transparent outside.
+};
+
+bool oguri_resample_params_equal(
+		const struct oguri_resample_params * a,
+		const struct oguri_resample_params * b);
+
+struct oguri_resampler;
+struct oguri_workers;
+
+struct oguri_resampler * oguri_resampler_create(
+		const struct oguri_resample_params * params);
+bool oguri_resampler_matches(
+		const struct oguri_resampler * resampler,
+		const struct oguri_resample_params * params);
+void oguri_resampler_run(
+		struct oguri_resampler * resampler,
+		cairo_surface_t * source,
+		cairo_surface_t * target);
+void oguri_resampler_run_many(
+		struct oguri_resampler ** resamplers,
+		cairo_surface_t ** targets,
+		int count,
+		cairo_surface_t * source,
+		struct oguri_workers * workers);
+void oguri_resampler_destroy(struct oguri_resampler * resampler);
+
+#endif
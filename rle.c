@@ -0,0 +1,137 @@
+//
+// Run-length encoding for cached frames
+//
+// Scaled wallpapers tend to have large flat areas, and upscaled pixel art is
+// nothing but runs of identical pixels and identical rows. Encoding those
+// runs is enough to shrink most frames several times over, while expanding
+// them again is little more than a memcpy.
+//
+// A frame is a stream of 32-bit words. Each token starts with a word whose
+// top two bits give its kind and whose remaining bits give a pixel count:
+//
+// - RUN: the next word is a pixel, repeated count times.
+// - LITERAL: the next count words are pixels, copied as they are.
+// - REPEAT_ROW: this row is the same as the one above it. No count.
+//
+// Tokens never span rows, so each row can be expanded on its own.
+//
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include "rle.h"
+
+#define TOKEN_KIND(word) ((word) & 0xc0000000u)
+#define TOKEN_COUNT(word) ((word) & 0x3fffffffu)
+#define TOKEN_RUN 0x40000000u
+#define TOKEN_LITERAL 0x80000000u
+#define TOKEN_REPEAT_ROW 0xc0000000u
+
+// Shorter runs are cheaper to leave in a literal.
+#define MIN_RUN 3
+
+static uint32_t * emit_literal(
+		uint32_t * out, const uint32_t * pixels, int count) {
+	if (count > 0) {
+		*out++ = TOKEN_LITERAL | count;
+		memcpy(out, pixels, count * sizeof(uint32_t));
+		out += count;
+	}
+	return out;
+}
+
+static uint32_t * compress_row(uint32_t * out, const uint32_t * row, int width) {
+	int literal_start = 0;
+	int x = 0;
+	while (x < width) {
+		uint32_t pixel = row[x];
+		int count = 1;
+		while (x + count < width && row[x + count] == pixel) {
+			++count;
+		}
+
+		if (count >= MIN_RUN) {
+			out = emit_literal(out, row + literal_start, x - literal_start);
+			*out++ = TOKEN_RUN | count;
+			*out++ = pixel;
+			literal_start = x + count;
+		}
+		x += count;
+	}
+	return emit_literal(out, row + literal_start, width - literal_start);
+}
+
+struct oguri_rle_frame * oguri_rle_compress(
+		const unsigned char * pixels, int width, int height, int stride) {
+	// Literals and runs alternate, and a run costs no more words than it has
+	// pixels, so a row can't take more than this.
+	size_t row_limit = (size_t)width + width / MIN_RUN + 2;
+
+	struct oguri_rle_frame * frame = malloc(sizeof(struct oguri_rle_frame) +
+			row_limit * height * sizeof(uint32_t));
+	if (!frame) {
+		return NULL;
+	}
+	frame->width = width;
+	frame->height = height;
+
+	uint32_t * out = frame->data;
+	const uint32_t * previous = NULL;
+	for (int y = 0; y < height; ++y) {
+		const uint32_t * row = (const uint32_t *)(pixels + (size_t)y * stride);
+		if (previous && memcmp(row, previous, width * sizeof(uint32_t)) == 0) {
+			*out++ = TOKEN_REPEAT_ROW;
+		}
+		else {
+			out = compress_row(out, row, width);
+		}
+		previous = row;
+	}
+
+	// Give back what we didn't need, which is usually most of it.
+	frame->length = out - frame->data;
+	struct oguri_rle_frame * shrunk = realloc(frame,
+			sizeof(struct oguri_rle_frame) + frame->length * sizeof(uint32_t));
+	return shrunk ? shrunk : frame;
+}
+
+void oguri_rle_expand(
+		const struct oguri_rle_frame * frame,
+		unsigned char * pixels,
+		int stride) {
+	const uint32_t * in = frame->data;
+	const uint32_t * previous = NULL;
+	for (int y = 0; y < frame->height; ++y) {
+		uint32_t * row = (uint32_t *)(pixels + (size_t)y * stride);
+
+		if (*in == TOKEN_REPEAT_ROW) {
+			memcpy(row, previous, frame->width * sizeof(uint32_t));
+			++in;
+			previous = row;
+			continue;
+		}
+
+		uint32_t * out = row;
+		uint32_t * end = row + frame->width;
+		while (out < end) {
+			uint32_t count = TOKEN_COUNT(*in);
+			if (TOKEN_KIND(*in) == TOKEN_RUN) {
+				uint32_t pixel = in[1];
+				for (uint32_t i = 0; i < count; ++i) {
+					out[i] = pixel;
+				}
+				in += 2;
+			}
+			else {
+				memcpy(out, in + 1, count * sizeof(uint32_t));
+				in += 1 + count;
+			}
+			out += count;
+		}
+		previous = row;
+	}
+}
+
+size_t oguri_rle_size(const struct oguri_rle_frame * frame) {
+	return sizeof(struct oguri_rle_frame) + frame->length * sizeof(uint32_t);
+}
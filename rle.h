@@ -0,0 +1,23 @@
+#ifndef OGURI_RLE_H
+#define OGURI_RLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A frame's pixels, run-length encoded. See rle.c for the format.
+struct oguri_rle_frame {
+	int width;
+	int height;
+	size_t length;  // Of data, in words.
+	uint32_t data[];
+};
+
+struct oguri_rle_frame * oguri_rle_compress(
+		const unsigned char * pixels, int width, int height, int stride);
+void oguri_rle_expand(
+		const struct oguri_rle_frame * frame,
+		unsigned char * pixels,
+		int stride);
+size_t oguri_rle_size(const struct oguri_rle_frame * frame);
+
+#endif
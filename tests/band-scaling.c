@@ -0,0 +1,168 @@
+//
+// Band scaling benchmark
+//
+// Times oguri_resampler_run_many scaling a frame up to 4K and 8K with one
+// thread, and then with the frame split into bands on each number of worker
+// threads up to the number of CPUs, which can be overridden by the first
+// argument. Every run has to come out the same as the one without workers.
+//
+// Timings with more threads than there are CPUs to run them are marked, since
+// all they show is the cost of splitting the frame up.
+//
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "../resample.h"
+#include "../workers.h"
+
+#define SOURCE_WIDTH 960
+#define SOURCE_HEIGHT 540
+#define ROUNDS 10
+
+struct target_size {
+	const char * name;
+	int width;
+	int height;
+};
+
+struct filter {
+	const char * name;
+	cairo_filter_t filter;
+};
+
+static double get_time(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Returns the time per frame in milliseconds, or a negative number if the
+// frame didn't match the expected one.
+static double time_frames(struct oguri_resampler * resampler,
+		cairo_surface_t * source, cairo_surface_t * target,
+		cairo_surface_t * expected, struct oguri_workers * workers) {
+	oguri_resampler_run_many(&resampler, &target, 1, source, workers);
+	size_t size = (size_t)cairo_image_surface_get_stride(target) *
+		cairo_image_surface_get_height(target);
+	if (expected && memcmp(cairo_image_surface_get_data(target),
+				cairo_image_surface_get_data(expected), size) != 0) {
+		return -1.0;
+	}
+
+	double start = get_time();
+	for (int i = 0; i < ROUNDS; ++i) {
+		oguri_resampler_run_many(&resampler, &target, 1, source, workers);
+	}
+	return (get_time() - start) * 1000 / ROUNDS;
+}
+
+static bool run_size(const struct target_size * size,
+		const struct filter * filter, cairo_surface_t * source,
+		long cpu_count, long max_threads) {
+	struct oguri_resample_params params = {
+		.source_width = SOURCE_WIDTH,
+		.source_height = SOURCE_HEIGHT,
+		.target_width = size->width,
+		.target_height = size->height,
+		.scale_x = (double)size->width / SOURCE_WIDTH,
+		.scale_y = (double)size->height / SOURCE_HEIGHT,
+		.filter = filter->filter,
+	};
+	struct oguri_resampler * resampler = oguri_resampler_create(&params);
+	cairo_surface_t * expected = cairo_image_surface_create(
+			CAIRO_FORMAT_ARGB32, size->width, size->height);
+	cairo_surface_t * target = cairo_image_surface_create(
+			CAIRO_FORMAT_ARGB32, size->width, size->height);
+	if (!resampler || cairo_surface_status(expected) ||
+			cairo_surface_status(target)) {
+		fprintf(stderr, "Out of memory\n");
+		return false;
+	}
+
+	bool ok = true;
+	double single = time_frames(resampler, source, expected, NULL, NULL);
+	printf("%s %-8s  1 thread:  %7.1f ms per frame\n",
+			size->name, filter->name, single);
+	for (long count = 2; count <= max_threads && ok; ++count) {
+		struct oguri_workers * workers = oguri_workers_create(count);
+		if (!workers) {
+			ok = false;
+			break;
+		}
+		double ms = time_frames(resampler, source, target, expected, workers);
+		if (ms < 0) {
+			fprintf(stderr, "%s %s with %ld threads differs from 1 thread\n",
+					size->name, filter->name, count);
+			ok = false;
+		}
+		else {
+			printf("%s %-8s %2ld threads: %7.1f ms per frame, %.2fx%s\n",
+					size->name, filter->name, count, ms, single / ms,
+					(count > cpu_count) ? " (more threads than CPUs)" : "");
+		}
+		oguri_workers_destroy(workers);
+	}
+
+	cairo_surface_destroy(target);
+	cairo_surface_destroy(expected);
+	oguri_resampler_destroy(resampler);
+	return ok;
+}
+
+int main(int argc, char * argv[]) {
+	long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpu_count < 1) {
+		cpu_count = 1;
+	}
+	// There's nothing to split between with fewer than two.
+	long max_threads = (argc > 1) ? atol(argv[1]) : cpu_count;
+	if (max_threads < 2) {
+		max_threads = 2;
+	}
+	printf("%ld CPUs online, %dx%d source\n",
+			cpu_count, SOURCE_WIDTH, SOURCE_HEIGHT);
+
+	cairo_surface_t * source = cairo_image_surface_create(
+			CAIRO_FORMAT_ARGB32, SOURCE_WIDTH, SOURCE_HEIGHT);
+	if (cairo_surface_status(source)) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	unsigned char * pixels = cairo_image_surface_get_data(source);
+	int stride = cairo_image_surface_get_stride(source);
+	for (int y = 0; y < SOURCE_HEIGHT; ++y) {
+		for (int x = 0; x < SOURCE_WIDTH * 4; x += 4) {
+			// Opaque, so that it's valid premultiplied.
+			unsigned char * pixel = pixels + y * stride + x;
+			pixel[0] = rand() & 0xff;
+			pixel[1] = rand() & 0xff;
+			pixel[2] = rand() & 0xff;
+			pixel[3] = 0xff;
+		}
+	}
+	cairo_surface_mark_dirty(source);
+
+	const struct target_size sizes[] = {
+		{"4K", 3840, 2160},
+		{"8K", 7680, 4320},
+	};
+	const struct filter filters[] = {
+		{"good", CAIRO_FILTER_GOOD},
+		{"best", CAIRO_FILTER_BEST},
+	};
+	bool ok = true;
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(*sizes) && ok; ++s) {
+		for (size_t f = 0; f < sizeof(filters) / sizeof(*filters) && ok; ++f) {
+			ok = run_size(&sizes[s], &filters[f], source,
+					cpu_count, max_threads);
+		}
+	}
+
+	cairo_surface_destroy(source);
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,145 @@
+//
+// First frame benchmark
+//
+// Times getting a new buffer slot ready and then drawing into it for the
+// first time, both the way pools are set up now (a sealed memfd, with the
+// slot prefaulted by prefault_slot) and the way they used to be (an
+// unlinked shm_open file, faulted in a page at a time by the drawing). Only
+// the total is really comparable, since the new way moves the cost of the
+// page faults from drawing to setup, where it's paid in one go.
+//
+#define _GNU_SOURCE  // Before anything else, for buffers.c
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../buffers.c"
+
+#define ROUNDS 10
+
+// buffers.c calls out to these, but nothing here gets that far.
+void oguri_frame_cache_release_buffer(struct oguri_frame_cache * cache,
+		struct oguri_buffer * buffer) {
+	(void)cache;
+	(void)buffer;
+}
+
+void oguri_animation_wait_for_workers(struct oguri_animation * anim) {
+	(void)anim;
+}
+
+struct frame_size {
+	const char * name;
+	int width;
+	int height;
+};
+
+struct timing {
+	double setup;
+	double draw;
+};
+
+static double get_time(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1e3 + now.tv_nsec / 1e6;
+}
+
+// Maps a pool with a single slot, ready to draw into.
+static bool map_slot(struct oguri_shm_pool * pool, bool prefault) {
+	if (ftruncate(pool->fd, pool->slot_size) < 0) {
+		fprintf(stderr, "ftruncate: %s\n", strerror(errno));
+		return false;
+	}
+	pool->data = mmap(NULL, pool->slot_size, PROT_READ|PROT_WRITE,
+			MAP_SHARED, pool->fd, 0);
+	if (pool->data == MAP_FAILED) {
+		fprintf(stderr, "mmap: %s\n", strerror(errno));
+		return false;
+	}
+	if (prefault) {
+		madvise(pool->data, pool->slot_size, MADV_HUGEPAGE);
+		prefault_slot(pool, 0);
+	}
+	return true;
+}
+
+static bool time_slot(const struct frame_size * size, bool memfd,
+		struct timing * timing) {
+	struct oguri_shm_pool pool = {
+		.stride = cairo_format_stride_for_width(CAIRO_FMT, size->width),
+	};
+	pool.slot_size = (size_t)pool.stride * size->height;
+
+	double start = get_time();
+	pool.fd = memfd ? create_shm_file() :
+		pid_shm_open("/oguri-buffer", O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (pool.fd < 0) {
+		fprintf(stderr, "Failed to create buffer memory: %s\n",
+				strerror(errno));
+		return false;
+	}
+	if (!map_slot(&pool, memfd)) {
+		close(pool.fd);
+		return false;
+	}
+	double ready = get_time();
+
+	// Drawing a frame writes every byte of the buffer, in order.
+	memset(pool.data, 0x80, pool.slot_size);
+	double drawn = get_time();
+
+	timing->setup += ready - start;
+	timing->draw += drawn - ready;
+	munmap(pool.data, pool.slot_size);
+	close(pool.fd);
+	return true;
+}
+
+static bool can_populate(void) {
+#ifdef MADV_POPULATE_WRITE
+	size_t size = sysconf(_SC_PAGESIZE);
+	void * data = mmap(NULL, size, PROT_READ|PROT_WRITE,
+			MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (data == MAP_FAILED) {
+		return false;
+	}
+	bool ok = madvise(data, size, MADV_POPULATE_WRITE) == 0;
+	munmap(data, size);
+	return ok;
+#else
+	return false;
+#endif
+}
+
+int main(void) {
+#ifndef HAVE_MEMFD_CREATE
+	printf("No memfd_create, so both ways are the same\n");
+#endif
+	printf("Slots are prefaulted with %s\n", can_populate() ?
+			"MADV_POPULATE_WRITE" : "fallocate (no MADV_POPULATE_WRITE)");
+
+	const struct frame_size sizes[] = {
+		{"1080p", 1920, 1080},
+		{"4K", 3840, 2160},
+		{"8K", 7680, 4320},
+	};
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(*sizes); ++s) {
+		struct timing old = {0}, new = {0};
+		for (int i = 0; i < ROUNDS; ++i) {
+			if (!time_slot(&sizes[s], false, &old) ||
+					!time_slot(&sizes[s], true, &new)) {
+				return 1;
+			}
+		}
+		printf("%-5s shm_open: %6.2f ms setup + %6.2f ms drawing = %6.2f ms\n",
+				sizes[s].name, old.setup / ROUNDS, old.draw / ROUNDS,
+				(old.setup + old.draw) / ROUNDS);
+		printf("%-5s memfd:    %6.2f ms setup + %6.2f ms drawing = %6.2f ms\n",
+				sizes[s].name, new.setup / ROUNDS, new.draw / ROUNDS,
+				(new.setup + new.draw) / ROUNDS);
+	}
+	return 0;
+}
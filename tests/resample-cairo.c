@@ -0,0 +1,299 @@
+//
+// Resampler against cairo
+//
+// The resampler stands in for cairo_paint with a scaling pattern, so it has
+// to come out the same as cairo, give or take one in any channel for the
+// difference in rounding. This scales random images both ways and compares
+// them: with every filter, up and down, by uneven amounts along each axis,
+// and with and without tiling.
+//
+// Given --benchmark, it instead times both ways of scaling some full-screen
+// frames, which is the whole reason for the resampler to exist.
+//
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../resample.h"
+
+#define RANDOM_CASES 200
+#define BENCHMARK_ROUNDS 5
+
+struct scale_case {
+	const char * name;
+	int source_width;
+	int source_height;
+	int target_width;
+	int target_height;
+	double offset_x;
+	double offset_y;
+	double scale;  // The same both ways, or 0 to stretch over the target.
+};
+
+static const struct {
+	const char * name;
+	cairo_filter_t filter;
+} filters[] = {
+	{"nearest", CAIRO_FILTER_NEAREST},
+	{"bilinear", CAIRO_FILTER_BILINEAR},
+	{"good", CAIRO_FILTER_GOOD},
+	{"best", CAIRO_FILTER_BEST},
+};
+
+#define FILTER_COUNT (sizeof(filters) / sizeof(*filters))
+
+// The same as scale_image_with_cairo in animation.c.
+static void scale_with_cairo(cairo_surface_t * target,
+		const struct oguri_resample_params * params,
+		cairo_surface_t * source) {
+	cairo_t * cairo = cairo_create(target);
+
+	cairo_matrix_t matrix;
+	cairo_matrix_init_identity(&matrix);
+	cairo_pattern_t * pattern = cairo_pattern_create_for_surface(source);
+	if (params->repeat) {
+		cairo_pattern_set_extend(pattern, CAIRO_EXTEND_REPEAT);
+	}
+
+	cairo_matrix_translate(&matrix, -params->offset_x, -params->offset_y);
+	cairo_matrix_scale(&matrix, 1 / params->scale_x, 1 / params->scale_y);
+	cairo_pattern_set_matrix(pattern, &matrix);
+	cairo_pattern_set_filter(pattern, params->filter);
+	cairo_set_operator(cairo, CAIRO_OPERATOR_SOURCE);
+	cairo_set_source(cairo, pattern);
+	cairo_paint(cairo);
+	cairo_pattern_destroy(pattern);
+	cairo_destroy(cairo);
+}
+
+// Fills the surface with random premultiplied pixels, including some fully
+// transparent and fully opaque ones, which are the likeliest to go wrong.
+static void fill_random(cairo_surface_t * surface) {
+	unsigned char * data = cairo_image_surface_get_data(surface);
+	int width = cairo_image_surface_get_width(surface);
+	int height = cairo_image_surface_get_height(surface);
+	int stride = cairo_image_surface_get_stride(surface);
+	for (int y = 0; y < height; ++y) {
+		for (int x = 0; x < width; ++x) {
+			unsigned char * pixel = data + y * stride + x * 4;
+			int alpha = rand() % 4 ? rand() & 0xff : (rand() % 2) * 0xff;
+			for (int c = 0; c < 3; ++c) {
+				pixel[c] = rand() % (alpha + 1);
+			}
+			pixel[3] = alpha;
+		}
+	}
+	cairo_surface_mark_dirty(surface);
+}
+
+static cairo_surface_t * create_surface(int width, int height) {
+	cairo_surface_t * surface = cairo_image_surface_create(
+			CAIRO_FORMAT_ARGB32, width, height);
+	if (cairo_surface_status(surface)) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	return surface;
+}
+
+static struct oguri_resample_params get_params(
+		const struct scale_case * scale, cairo_filter_t filter, bool repeat) {
+	return (struct oguri_resample_params) {
+		.source_width = scale->source_width,
+		.source_height = scale->source_height,
+		.target_width = scale->target_width,
+		.target_height = scale->target_height,
+		.scale_x = scale->scale ? scale->scale :
+			(double)scale->target_width / scale->source_width,
+		.scale_y = scale->scale ? scale->scale :
+			(double)scale->target_height / scale->source_height,
+		.offset_x = scale->offset_x,
+		.offset_y = scale->offset_y,
+		.filter = filter,
+		.repeat = repeat,
+	};
+}
+
+// Also keeps track of the largest difference seen in any channel so far.
+static bool compare_case(const struct scale_case * scale,
+		cairo_filter_t filter, const char * filter_name, bool repeat,
+		int * worst_overall) {
+	struct oguri_resample_params params = get_params(scale, filter, repeat);
+	struct oguri_resampler * resampler = oguri_resampler_create(&params);
+	if (!resampler) {
+		fprintf(stderr, "Failed to create resampler\n");
+		return false;
+	}
+
+	cairo_surface_t * source = create_surface(
+			scale->source_width, scale->source_height);
+	cairo_surface_t * expected = create_surface(
+			scale->target_width, scale->target_height);
+	cairo_surface_t * target = create_surface(
+			scale->target_width, scale->target_height);
+	fill_random(source);
+	scale_with_cairo(expected, &params, source);
+	oguri_resampler_run(resampler, source, target);
+	cairo_surface_flush(expected);
+	cairo_surface_flush(target);
+
+	const unsigned char * a = cairo_image_surface_get_data(expected);
+	const unsigned char * b = cairo_image_surface_get_data(target);
+	int stride = cairo_image_surface_get_stride(target);
+	int worst = 0;
+	int worst_x = 0;
+	int worst_y = 0;
+	int off = 0;
+	for (int y = 0; y < scale->target_height; ++y) {
+		for (int x = 0; x < scale->target_width * 4; ++x) {
+			int difference = abs(a[y * stride + x] - b[y * stride + x]);
+			if (difference > 1) {
+				++off;
+			}
+			if (difference > worst) {
+				worst = difference;
+				worst_x = x / 4;
+				worst_y = y;
+			}
+		}
+	}
+	if (off) {
+		fprintf(stderr, "%s, %s%s (%dx%d to %dx%d, offset %g,%g): %d channels "
+				"off by more than 1, worst by %d at %d,%d\n",
+				scale->name, filter_name, repeat ? ", tiled" : "",
+				scale->source_width, scale->source_height,
+				scale->target_width, scale->target_height,
+				scale->offset_x, scale->offset_y,
+				off, worst, worst_x, worst_y);
+	}
+
+	if (worst > *worst_overall) {
+		*worst_overall = worst;
+	}
+
+	cairo_surface_destroy(target);
+	cairo_surface_destroy(expected);
+	cairo_surface_destroy(source);
+	oguri_resampler_destroy(resampler);
+	return off == 0;
+}
+
+static int run_comparisons(void) {
+	const struct scale_case scales[] = {
+		{"same size", 61, 37, 61, 37, 0, 0, 0},
+		{"same size, shifted", 61, 37, 61, 37, 0.25, -0.5, 0},
+		{"2x", 61, 37, 122, 74, 0, 0, 0},
+		{"3x", 61, 37, 183, 111, 0, 0, 0},
+		{"2x, centred", 61, 37, 150, 90, 7, 4, 2.0},
+		{"2x, over and over", 61, 37, 300, 200, 0, 0, 2.0},
+		{"1.37x", 61, 37, 84, 51, 0.3, 0.7, 0},
+		{"0.8x", 61, 37, 49, 30, 0, 0, 0},
+		{"0.5x, lined up", 64, 40, 32, 20, 0, 0, 0},
+		{"0.5x, shifted", 64, 40, 32, 20, 0.5, 0.25, 0},
+		{"0.3x", 97, 61, 29, 18, 0, 0, 0},
+		{"0.05x", 400, 240, 20, 12, 0, 0, 0},
+		{"0.05x across, 3x along", 400, 20, 20, 60, 0, 0, 0},
+		{"2x across, 0.05x along", 30, 400, 60, 20, 0.5, 0, 0},
+		{"up across, down along", 61, 37, 92, 22, 0, 0, 0},
+		{"down across, up along", 61, 37, 22, 92, 0, 0, 0},
+		{"slightly down one way", 61, 37, 90, 33, 0, 0, 0},
+		{"uneven, shifted", 61, 37, 100, 50, -10.5, 0, 0},
+	};
+
+	bool ok = true;
+	int worst = 0;
+	for (size_t s = 0; s < sizeof(scales) / sizeof(*scales); ++s) {
+		for (size_t f = 0; f < FILTER_COUNT; ++f) {
+			for (int repeat = 0; repeat < 2; ++repeat) {
+				ok &= compare_case(&scales[s], filters[f].filter,
+						filters[f].name, repeat, &worst);
+			}
+		}
+	}
+
+	for (int i = 0; i < RANDOM_CASES; ++i) {
+		struct scale_case scale = {
+			.name = "random",
+			.source_width = 1 + rand() % 80,
+			.source_height = 1 + rand() % 80,
+			.target_width = 1 + rand() % 160,
+			.target_height = 1 + rand() % 160,
+			.offset_x = (rand() % 17 - 8) / 4.0,
+			.offset_y = (rand() % 17 - 8) / 4.0,
+		};
+		ok &= compare_case(&scale, filters[i % FILTER_COUNT].filter,
+				filters[i % FILTER_COUNT].name, rand() % 2, &worst);
+	}
+
+	printf("%s, at most %d off in any channel\n",
+			ok ? "Everything within 1 of cairo" : "Differences found", worst);
+	return ok ? 0 : 1;
+}
+
+static double get_time(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1e3 + now.tv_nsec / 1e6;
+}
+
+static int run_benchmarks(void) {
+	const struct scale_case scales[] = {
+		{"960x540 to 4K", 960, 540, 3840, 2160, 0, 0, 0},
+		{"1440x1080 to 4K", 1440, 1080, 3840, 2160, 240, 0, 2.0},
+		{"4K to 1080p", 3840, 2160, 1920, 1080, 0, 0, 0},
+		{"5K to 1440p", 5120, 2880, 2560, 1440, 0, 0, 0},
+	};
+
+	for (size_t s = 0; s < sizeof(scales) / sizeof(*scales); ++s) {
+		const struct scale_case * scale = &scales[s];
+		cairo_surface_t * source = create_surface(
+				scale->source_width, scale->source_height);
+		cairo_surface_t * target = create_surface(
+				scale->target_width, scale->target_height);
+		fill_random(source);
+
+		// Pixman has fast paths of its own for nearest, so that's left out.
+		for (size_t f = 1; f < FILTER_COUNT; ++f) {
+			struct oguri_resample_params params = get_params(
+					scale, filters[f].filter, false);
+			struct oguri_resampler * resampler =
+				oguri_resampler_create(&params);
+			if (!resampler) {
+				fprintf(stderr, "Failed to create resampler\n");
+				return 1;
+			}
+
+			double start = get_time();
+			for (int i = 0; i < BENCHMARK_ROUNDS; ++i) {
+				scale_with_cairo(target, &params, source);
+			}
+			double cairo_time = (get_time() - start) / BENCHMARK_ROUNDS;
+
+			start = get_time();
+			for (int i = 0; i < BENCHMARK_ROUNDS; ++i) {
+				oguri_resampler_run(resampler, source, target);
+			}
+			double resampler_time = (get_time() - start) / BENCHMARK_ROUNDS;
+
+			printf("%-22s %-8s cairo %7.1f ms, resampler %7.1f ms, %.1fx\n",
+					scale->name, filters[f].name, cairo_time, resampler_time,
+					cairo_time / resampler_time);
+			oguri_resampler_destroy(resampler);
+		}
+
+		cairo_surface_destroy(target);
+		cairo_surface_destroy(source);
+	}
+	return 0;
+}
+
+int main(int argc, char * argv[]) {
+	srand(1);
+	if (argc > 1 && strcmp(argv[1], "--benchmark") == 0) {
+		return run_benchmarks();
+	}
+	return run_comparisons();
+}
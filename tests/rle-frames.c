@@ -0,0 +1,221 @@
+//
+// RLE benchmark
+//
+// Decodes every frame of an image the way the animation does, and
+// times compressing and expanding each one with oguri_rle_*. By default the
+// frames are used at their own size; given a width and height as well, they
+// are first scaled to that, like they would be for an output that size, with
+// the good filter unless another one is named. Each frame has to expand back
+// to exactly what was compressed.
+//
+// Expanding is compared to a plain memcpy of the frame, which is what it
+// costs to copy an uncompressed cached frame instead.
+//
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../cairo-pixbuf.h"
+#include "../probe.h"
+#include "../resample.h"
+#include "../rle.h"
+
+#define EXPAND_ROUNDS 20
+
+struct totals {
+	unsigned int frames;
+	size_t raw_size;
+	size_t packed_size;
+	double compress_time;
+	double expand_time;
+	double copy_time;
+};
+
+static double get_time(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1e6 + now.tv_nsec / 1e3;
+}
+
+static bool measure_frame(cairo_surface_t * frame, unsigned int index,
+		unsigned char * scratch, struct totals * totals) {
+	cairo_surface_flush(frame);
+	const unsigned char * pixels = cairo_image_surface_get_data(frame);
+	int width = cairo_image_surface_get_width(frame);
+	int height = cairo_image_surface_get_height(frame);
+	int stride = cairo_image_surface_get_stride(frame);
+	size_t size = (size_t)stride * height;
+
+	double start = get_time();
+	struct oguri_rle_frame * packed = oguri_rle_compress(
+			pixels, width, height, stride);
+	double compressed = get_time();
+	if (!packed) {
+		fprintf(stderr, "Failed to compress frame %u\n", index);
+		return false;
+	}
+
+	oguri_rle_expand(packed, scratch, stride);
+	bool same = memcmp(scratch, pixels, size) == 0;
+
+	double expand_start = get_time();
+	for (int i = 0; i < EXPAND_ROUNDS; ++i) {
+		oguri_rle_expand(packed, scratch, stride);
+	}
+	double expand_time = (get_time() - expand_start) / EXPAND_ROUNDS;
+
+	double copy_start = get_time();
+	for (int i = 0; i < EXPAND_ROUNDS; ++i) {
+		memcpy(scratch, pixels, size);
+	}
+	double copy_time = (get_time() - copy_start) / EXPAND_ROUNDS;
+
+	size_t packed_size = oguri_rle_size(packed);
+	printf("frame %3u: %9zu -> %9zu bytes (%5.1fx), compress %8.1f us, "
+			"expand %8.1f us, memcpy %8.1f us\n",
+			index, size, packed_size, (double)size / packed_size,
+			compressed - start, expand_time, copy_time);
+	free(packed);
+	if (!same) {
+		fprintf(stderr, "Frame %u didn't expand to what was compressed\n",
+				index);
+		return false;
+	}
+
+	++totals->frames;
+	totals->raw_size += size;
+	totals->packed_size += packed_size;
+	totals->compress_time += compressed - start;
+	totals->expand_time += expand_time;
+	totals->copy_time += copy_time;
+	return true;
+}
+
+static bool parse_filter(const char * name, cairo_filter_t * filter) {
+	if (strcmp(name, "nearest") == 0) {
+		*filter = CAIRO_FILTER_NEAREST;
+	}
+	else if (strcmp(name, "bilinear") == 0) {
+		*filter = CAIRO_FILTER_BILINEAR;
+	}
+	else if (strcmp(name, "good") == 0) {
+		*filter = CAIRO_FILTER_GOOD;
+	}
+	else if (strcmp(name, "best") == 0) {
+		*filter = CAIRO_FILTER_BEST;
+	}
+	else {
+		return false;
+	}
+	return true;
+}
+
+int main(int argc, char * argv[]) {
+	cairo_filter_t filter = CAIRO_FILTER_GOOD;
+	if ((argc != 2 && argc != 4 && argc != 5) ||
+			(argc == 5 && !parse_filter(argv[4], &filter))) {
+		fprintf(stderr, "Usage: %s <image> [<width> <height> "
+				"[nearest|bilinear|good|best]]\n", argv[0]);
+		return 1;
+	}
+	const char * path = argv[1];
+
+	GdkPixbufAnimation * image = gdk_pixbuf_animation_new_from_file(path, NULL);
+	if (!image) {
+		fprintf(stderr, "Failed to load %s\n", path);
+		return 1;
+	}
+	unsigned int frame_count = 1;
+	struct oguri_probe probe = {0};
+	if (!gdk_pixbuf_animation_is_static_image(image) &&
+			oguri_probe_image(path, &probe)) {
+		frame_count = probe.frame_count;
+		oguri_probe_finish(&probe);
+	}
+
+	int source_width = gdk_pixbuf_animation_get_width(image);
+	int source_height = gdk_pixbuf_animation_get_height(image);
+	int width = (argc > 2) ? atoi(argv[2]) : source_width;
+	int height = (argc > 2) ? atoi(argv[3]) : source_height;
+	if (width < 1 || height < 1) {
+		fprintf(stderr, "Bad size %dx%d\n", width, height);
+		return 1;
+	}
+	printf("%s: %u frames, %dx%d scaled to %dx%d\n", path, frame_count,
+			source_width, source_height, width, height);
+
+	cairo_surface_t * source = cairo_image_surface_create(
+			CAIRO_FORMAT_ARGB32, source_width, source_height);
+	cairo_surface_t * target = source;
+	struct oguri_resampler * resampler = NULL;
+	if (width != source_width || height != source_height) {
+		struct oguri_resample_params params = {
+			.source_width = source_width,
+			.source_height = source_height,
+			.target_width = width,
+			.target_height = height,
+			.scale_x = (double)width / source_width,
+			.scale_y = (double)height / source_height,
+			.filter = filter,
+		};
+		resampler = oguri_resampler_create(&params);
+		target = cairo_image_surface_create(
+				CAIRO_FORMAT_ARGB32, width, height);
+	}
+	unsigned char * scratch = malloc(
+			(size_t)cairo_image_surface_get_stride(target) * height);
+	if (cairo_surface_status(source) || cairo_surface_status(target) ||
+			(target != source && !resampler) || !scratch) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	G_GNUC_BEGIN_IGNORE_DEPRECATIONS  // gdk-pixbuf still takes GTimeVals.
+	GTimeVal time = {0};
+	GdkPixbufAnimationIter * iter = gdk_pixbuf_animation_get_iter(image, &time);
+	long elapsed = 0;
+	struct totals totals = {0};
+	bool ok = true;
+	for (unsigned int i = 0; i < frame_count && ok; ++i) {
+		GdkPixbuf * frame = gdk_pixbuf_animation_iter_get_pixbuf(iter);
+		ok = oguri_cairo_surface_paint_pixbuf(source, frame) == 0;
+		if (ok && resampler) {
+			oguri_resampler_run(resampler, source, target);
+		}
+		ok = ok && measure_frame(target, i, scratch, &totals);
+
+		// As in the animation, frames with no delay still take up a moment.
+		int delay = gdk_pixbuf_animation_iter_get_delay_time(iter);
+		if (delay < 0) {
+			break;
+		}
+		elapsed += (delay == 0) ? 1 : delay;
+		time.tv_sec = elapsed / 1000;
+		time.tv_usec = (elapsed % 1000) * 1000;
+		gdk_pixbuf_animation_iter_advance(iter, &time);
+	}
+	G_GNUC_END_IGNORE_DEPRECATIONS
+
+	if (totals.frames > 0) {
+		printf("%u frames: %zu -> %zu bytes (%.1fx), per frame: "
+				"compress %.1f us, expand %.1f us, memcpy %.1f us\n",
+				totals.frames, totals.raw_size, totals.packed_size,
+				(double)totals.raw_size / totals.packed_size,
+				totals.compress_time / totals.frames,
+				totals.expand_time / totals.frames,
+				totals.copy_time / totals.frames);
+	}
+
+	free(scratch);
+	if (resampler) {
+		oguri_resampler_destroy(resampler);
+		cairo_surface_destroy(target);
+	}
+	cairo_surface_destroy(source);
+	g_object_unref(iter);
+	g_object_unref(image);
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,167 @@
+//
+// Row converter test
+//
+// The SIMD row converters must produce exactly the same bytes as the scalar
+// ones. This runs every one the CPU supports over random rows of every width
+// up to a few vectors long, each in a buffer of exactly the right size so
+// that reading or writing past the end shows up under a sanitizer, and then
+// whole pixbufs with odd widths and padded strides through
+// oguri_cairo_surface_paint_pixbuf.
+//
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../cairo-pixbuf.c"
+
+#define MAX_WIDTH 77
+#define ROUNDS 300
+#define PIXBUF_ROUNDS 200
+
+struct converter {
+	const char * name;
+	oguri_row_converter_t * convert;
+	oguri_row_converter_t * reference;
+	int channels;
+};
+
+static void fill_random(guint8 * data, size_t size) {
+	for (size_t i = 0; i < size; ++i) {
+		data[i] = rand() & 0xff;
+	}
+
+	// Fully transparent and fully opaque pixels are the likeliest to go
+	// wrong, and too rare to come up by chance.
+	if (size > 8 && rand() % 2) {
+		data[3] = 0x00;
+		data[7] = 0xff;
+	}
+}
+
+static bool check_rows(const struct converter * converter) {
+	for (int width = 1; width <= MAX_WIDTH; ++width) {
+		size_t source_size = (size_t)width * converter->channels;
+		size_t target_size = (size_t)width * 4;
+		guint8 * source = malloc(source_size);
+		unsigned char * expected = malloc(target_size);
+		unsigned char * target = malloc(target_size);
+		if (!source || !expected || !target) {
+			fprintf(stderr, "Out of memory\n");
+			return false;
+		}
+
+		bool ok = true;
+		for (int round = 0; round < ROUNDS && ok; ++round) {
+			fill_random(source, source_size);
+			memset(target, 0x5a, target_size);
+			converter->reference(source, expected, width);
+			converter->convert(source, target, width);
+			for (size_t i = 0; i < target_size; ++i) {
+				if (target[i] != expected[i]) {
+					fprintf(stderr, "%s: width %d, byte %zu is %02x, "
+							"expected %02x\n", converter->name, width, i,
+							target[i], expected[i]);
+					ok = false;
+					break;
+				}
+			}
+		}
+
+		free(source);
+		free(expected);
+		free(target);
+		if (!ok) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Paints a pixbuf through whichever converters were picked, and checks each
+// row against the scalar ones.
+static bool check_pixbuf(int channels) {
+	int width = 1 + rand() % MAX_WIDTH;
+	int height = 1 + rand() % 9;
+	int stride = width * channels + rand() % 8;
+
+	guint8 * pixels = malloc((size_t)stride * height);
+	if (!pixels) {
+		fprintf(stderr, "Out of memory\n");
+		return false;
+	}
+	fill_random(pixels, (size_t)stride * height);
+	GdkPixbuf * pixbuf = gdk_pixbuf_new_from_data(pixels,
+			GDK_COLORSPACE_RGB, channels == 4, 8, width, height, stride,
+			NULL, NULL);
+	cairo_surface_t * surface = cairo_image_surface_create(
+			(channels == 3) ? CAIRO_FORMAT_RGB24 : CAIRO_FORMAT_ARGB32,
+			width, height);
+
+	bool ok = oguri_cairo_surface_paint_pixbuf(surface, pixbuf) == 0;
+	cairo_surface_flush(surface);
+	unsigned char * data = cairo_image_surface_get_data(surface);
+	int target_stride = cairo_image_surface_get_stride(surface);
+	unsigned char expected[MAX_WIDTH * 4];
+	for (int y = 0; y < height && ok; ++y) {
+		if (channels == 3) {
+			swizzle_row_scalar(pixels + y * stride, expected, width);
+		}
+		else {
+			premultiply_row_scalar(pixels + y * stride, expected, width);
+		}
+		if (memcmp(data + y * target_stride, expected, width * 4) != 0) {
+			fprintf(stderr, "%d channel pixbuf %dx%d, stride %d: row %d "
+					"differs\n", channels, width, height, stride, y);
+			ok = false;
+		}
+	}
+
+	cairo_surface_destroy(surface);
+	g_object_unref(pixbuf);
+	free(pixels);
+	return ok;
+}
+
+int main(int argc, char * argv[]) {
+	srand(argc > 1 ? atoi(argv[1]) : 1);
+
+	struct converter converters[4];
+	int count = 0;
+#ifdef OGURI_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("ssse3")) {
+		converters[count++] = (struct converter) {"swizzle_row_ssse3",
+			swizzle_row_ssse3, swizzle_row_scalar, 3};
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		converters[count++] = (struct converter) {"swizzle_row_avx2",
+			swizzle_row_avx2, swizzle_row_scalar, 3};
+		converters[count++] = (struct converter) {"premultiply_row_avx2",
+			premultiply_row_avx2, premultiply_row_scalar, 4};
+	}
+	if (__builtin_cpu_supports("sse2")) {
+		converters[count++] = (struct converter) {"premultiply_row_sse2",
+			premultiply_row_sse2, premultiply_row_scalar, 4};
+	}
+#endif
+
+	int failed = 0;
+	for (int i = 0; i < count; ++i) {
+		bool ok = check_rows(&converters[i]);
+		printf("%s: %s\n", converters[i].name, ok ? "ok" : "FAILED");
+		failed += !ok;
+	}
+	if (count == 0) {
+		printf("No SIMD row converters on this CPU\n");
+	}
+
+	for (int round = 0; round < PIXBUF_ROUNDS; ++round) {
+		if (!check_pixbuf(3) || !check_pixbuf(4)) {
+			++failed;
+			break;
+		}
+	}
+	printf("oguri_cairo_surface_paint_pixbuf: %s\n",
+			failed ? "FAILED" : "ok");
+	return failed ? 1 : 0;
+}
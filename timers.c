@@ -0,0 +1,223 @@
+//
+// Timers
+//
+// Every animation's next deadline is kept in one min-heap, behind a single
+// timerfd armed for whichever is soonest. When it goes off, everything else
+// due within the slack window is run along with it, so animations whose
+// frames fall close together share a wakeup, and a flush, rather than each
+// having its own.
+//
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+#include "timers.h"
+
+struct oguri_timers {
+	int fd;
+	uint64_t armed;  // What fd is set for, 0 if nothing.
+
+	struct oguri_timer ** heap;
+	unsigned int length;
+	unsigned int allocated;
+
+	// Statistics
+	uint64_t created;
+	unsigned int wakeups;
+	unsigned int fired;
+	// What wakeups would have been with a timer for each animation, which
+	// is one for every distinct deadline fired.
+	unsigned int separate_wakeups;
+};
+
+uint64_t oguri_get_time_ns(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+//
+// Heap
+//
+
+static void heap_place(struct oguri_timers * timers,
+		struct oguri_timer * timer, unsigned int index) {
+	timers->heap[index] = timer;
+	timer->heap_index = index;
+}
+
+static void heap_up(struct oguri_timers * timers, unsigned int index) {
+	struct oguri_timer * timer = timers->heap[index];
+	while (index > 0) {
+		unsigned int parent = (index - 1) / 2;
+		if (timers->heap[parent]->deadline <= timer->deadline) {
+			break;
+		}
+		heap_place(timers, timers->heap[parent], index);
+		index = parent;
+	}
+	heap_place(timers, timer, index);
+}
+
+static void heap_down(struct oguri_timers * timers, unsigned int index) {
+	struct oguri_timer * timer = timers->heap[index];
+	for (;;) {
+		unsigned int child = index * 2 + 1;
+		if (child >= timers->length) {
+			break;
+		}
+		if (child + 1 < timers->length && timers->heap[child + 1]->deadline <
+				timers->heap[child]->deadline) {
+			++child;
+		}
+		if (timer->deadline <= timers->heap[child]->deadline) {
+			break;
+		}
+		heap_place(timers, timers->heap[child], index);
+		index = child;
+	}
+	heap_place(timers, timer, index);
+}
+
+static void heap_remove(struct oguri_timers * timers, struct oguri_timer * timer) {
+	unsigned int index = timer->heap_index;
+	struct oguri_timer * last = timers->heap[--timers->length];
+	if (last == timer) {
+		return;
+	}
+	heap_place(timers, last, index);
+	heap_up(timers, index);
+	heap_down(timers, last->heap_index);
+}
+
+static bool heap_insert(struct oguri_timers * timers, struct oguri_timer * timer) {
+	if (timers->length == timers->allocated) {
+		unsigned int allocated = timers->allocated ? timers->allocated * 2 : 8;
+		struct oguri_timer ** heap = realloc(
+				timers->heap, allocated * sizeof(struct oguri_timer *));
+		if (!heap) {
+			return false;
+		}
+		timers->heap = heap;
+		timers->allocated = allocated;
+	}
+	heap_place(timers, timer, timers->length++);
+	heap_up(timers, timer->heap_index);
+	return true;
+}
+
+//
+// Timer fd
+//
+
+// Points the fd at the soonest deadline, if it isn't already.
+static bool arm(struct oguri_timers * timers) {
+	uint64_t deadline = timers->length ? timers->heap[0]->deadline : 0;
+	if (deadline == timers->armed) {
+		return true;
+	}
+
+	struct itimerspec spec = {
+		.it_value = (struct timespec) {
+			.tv_sec = deadline / 1000000000,
+			.tv_nsec = deadline % 1000000000,
+		},
+	};
+	int ret = timerfd_settime(timers->fd, TFD_TIMER_ABSTIME, &spec, NULL);
+	if (ret < 0) {
+		fprintf(stderr, "Timer error (fd %d): %s\n", timers->fd, strerror(errno));
+		timers->armed = 0;
+		return false;
+	}
+
+	timers->armed = deadline;
+	return true;
+}
+
+struct oguri_timers * oguri_timers_create(void) {
+	struct oguri_timers * timers = calloc(1, sizeof(struct oguri_timers));
+	if (!timers) {
+		return NULL;
+	}
+	timers->fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if (timers->fd < 0) {
+		fprintf(stderr, "Could not create timer: %s\n", strerror(errno));
+		free(timers);
+		return NULL;
+	}
+	timers->created = oguri_get_time_ns();
+	return timers;
+}
+
+void oguri_timers_destroy(struct oguri_timers * timers) {
+	close(timers->fd);
+	free(timers->heap);
+	free(timers);
+}
+
+int oguri_timers_get_fd(struct oguri_timers * timers) {
+	return timers->fd;
+}
+
+// Sets the timer to fire at the given time, replacing whatever it was set to
+// before, or stops it for zero.
+bool oguri_timer_set(struct oguri_timers * timers,
+		struct oguri_timer * timer, uint64_t deadline) {
+	if (timer->deadline) {
+		heap_remove(timers, timer);
+	}
+	timer->deadline = deadline;
+	if (deadline && !heap_insert(timers, timer)) {
+		fprintf(stderr, "Could not schedule timer\n");
+		timer->deadline = 0;
+		arm(timers);
+		return false;
+	}
+	return arm(timers);
+}
+
+// Fires every timer that's due, or will be within slack nanoseconds. No more
+// are fired than were set to begin with, so a timer which keeps setting
+// itself for a time that's already past can't hold up the main loop.
+void oguri_timers_run(struct oguri_timers * timers, uint64_t slack) {
+	uint64_t expirations;
+	if (read(timers->fd, &expirations, sizeof(expirations)) < 0 &&
+			errno != EAGAIN) {
+		fprintf(stderr, "Failed to read timer events: %s\n", strerror(errno));
+	}
+	timers->armed = 0;
+	++timers->wakeups;
+
+	uint64_t until = oguri_get_time_ns() + slack;
+	uint64_t last_deadline = 0;
+	unsigned int count = timers->length;
+	for (unsigned int i = 0; i < count && timers->length; ++i) {
+		struct oguri_timer * timer = timers->heap[0];
+		if (timer->deadline > until) {
+			break;
+		}
+		// They come off the heap in order, so equal deadlines are together.
+		if (timer->deadline != last_deadline) {
+			last_deadline = timer->deadline;
+			++timers->separate_wakeups;
+		}
+		heap_remove(timers, timer);
+		timer->deadline = 0;
+		++timers->fired;
+		timer->fire(timer, until);
+	}
+	arm(timers);
+}
+
+void oguri_timers_print_stats(struct oguri_timers * timers, FILE * stream) {
+	double seconds = (oguri_get_time_ns() - timers->created) / 1e9;
+	fprintf(stream, "timers: %u set, %u fired in %u wakeups (%.1f per second, "
+			"%.1f without sharing them)\n",
+			timers->length, timers->fired, timers->wakeups,
+			seconds > 0 ? timers->wakeups / seconds : 0.0,
+			seconds > 0 ? timers->separate_wakeups / seconds : 0.0);
+}
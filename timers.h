@@ -0,0 +1,33 @@
+#ifndef OGURI_TIMERS_H
+#define OGURI_TIMERS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+struct oguri_timer;
+typedef void oguri_timer_fn(struct oguri_timer * timer, uint64_t now);
+
+// Something to be woken up for at a CLOCK_MONOTONIC time, embedded in
+// whatever it belongs to. fire is called from oguri_timers_run with the time
+// it's running timers up to, which may be a little after now.
+struct oguri_timer {
+	oguri_timer_fn * fire;
+	uint64_t deadline;  // Nanoseconds, 0 when not set.
+	unsigned int heap_index;
+};
+
+struct oguri_timers;
+
+struct oguri_timers * oguri_timers_create(void);
+void oguri_timers_destroy(struct oguri_timers * timers);
+int oguri_timers_get_fd(struct oguri_timers * timers);
+
+bool oguri_timer_set(struct oguri_timers * timers,
+		struct oguri_timer * timer, uint64_t deadline);
+void oguri_timers_run(struct oguri_timers * timers, uint64_t slack);
+void oguri_timers_print_stats(struct oguri_timers * timers, FILE * stream);
+
+uint64_t oguri_get_time_ns(void);
+
+#endif
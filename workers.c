@@ -0,0 +1,423 @@
+//
+// Worker threads
+//
+// Jobs are handed to the workers, and handed back to the main thread once
+// they're done, through a pair of lock-free queues. Neither side ever waits
+// on the other to get at a queue, so the main thread can keep committing
+// frames while the workers are busy. An eventfd wakes the main loop when
+// there's something to collect.
+//
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include "workers.h"
+
+// Much more than will ever be queued at once, there's at most one job per
+// animation in flight.
+#define OGURI_QUEUE_LENGTH 256
+
+//
+// Queue
+//
+
+// A bounded queue which any number of threads can push to and pop from at
+// once, after Dmitry Vyukov's. Each cell's sequence number says whose turn it
+// is: a pusher may fill it when it equals the position being pushed, and a
+// popper may empty it once it's one past the position being popped.
+struct oguri_queue_cell {
+	atomic_size_t sequence;
+	struct oguri_job * job;
+};
+
+struct oguri_queue {
+	struct oguri_queue_cell cells[OGURI_QUEUE_LENGTH];
+	atomic_size_t head;  // Next position to pop.
+	atomic_size_t tail;  // Next position to push.
+};
+
+static void queue_init(struct oguri_queue * queue) {
+	for (size_t i = 0; i < OGURI_QUEUE_LENGTH; ++i) {
+		atomic_init(&queue->cells[i].sequence, i);
+		queue->cells[i].job = NULL;
+	}
+	atomic_init(&queue->head, 0);
+	atomic_init(&queue->tail, 0);
+}
+
+static bool queue_push(struct oguri_queue * queue, struct oguri_job * job) {
+	size_t position = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+	struct oguri_queue_cell * cell;
+	for (;;) {
+		cell = &queue->cells[position % OGURI_QUEUE_LENGTH];
+		size_t sequence = atomic_load_explicit(
+				&cell->sequence, memory_order_acquire);
+		intptr_t turn = (intptr_t)sequence - (intptr_t)position;
+		if (turn == 0) {
+			if (atomic_compare_exchange_weak_explicit(&queue->tail,
+						&position, position + 1,
+						memory_order_relaxed, memory_order_relaxed)) {
+				break;
+			}
+		}
+		else if (turn < 0) {
+			return false;  // Full
+		}
+		else {
+			// Someone else pushed here first.
+			position = atomic_load_explicit(
+					&queue->tail, memory_order_relaxed);
+		}
+	}
+
+	cell->job = job;
+	atomic_store_explicit(&cell->sequence, position + 1, memory_order_release);
+	return true;
+}
+
+static struct oguri_job * queue_pop(struct oguri_queue * queue) {
+	size_t position = atomic_load_explicit(&queue->head, memory_order_relaxed);
+	struct oguri_queue_cell * cell;
+	for (;;) {
+		cell = &queue->cells[position % OGURI_QUEUE_LENGTH];
+		size_t sequence = atomic_load_explicit(
+				&cell->sequence, memory_order_acquire);
+		intptr_t turn = (intptr_t)sequence - (intptr_t)(position + 1);
+		if (turn == 0) {
+			if (atomic_compare_exchange_weak_explicit(&queue->head,
+						&position, position + 1,
+						memory_order_relaxed, memory_order_relaxed)) {
+				break;
+			}
+		}
+		else if (turn < 0) {
+			return NULL;  // Empty
+		}
+		else {
+			// Someone else popped this one first.
+			position = atomic_load_explicit(
+					&queue->head, memory_order_relaxed);
+		}
+	}
+
+	struct oguri_job * job = cell->job;
+	atomic_store_explicit(&cell->sequence,
+			position + OGURI_QUEUE_LENGTH, memory_order_release);
+	return job;
+}
+
+//
+// Workers
+//
+
+struct oguri_workers {
+	pthread_t * threads;
+	unsigned int thread_count;
+	atomic_bool stop;
+
+	struct oguri_queue jobs;
+	sem_t pending;  // One post for each job pushed.
+
+	struct oguri_queue done;
+	int done_fd;  // eventfd, readable while done might have something in it.
+
+	// For oguri_workers_run, to sleep until the workers have finished its
+	// jobs.
+	pthread_mutex_t finished_mutex;
+	pthread_cond_t finished_cond;
+};
+
+static void run_job(struct oguri_workers * workers, struct oguri_job * job) {
+	// Jobs without a done callback are oguri_workers_run's tickets, which
+	// see to themselves, and may be gone as soon as they've run.
+	oguri_job_fn * done = job->done;
+	job->run(job);
+	if (!done) {
+		return;
+	}
+
+	// The queue can't fill up, there are never that many jobs about.
+	while (!queue_push(&workers->done, job)) {
+		sched_yield();
+	}
+	uint64_t one = 1;
+	if (write(workers->done_fd, &one, sizeof(one)) < 0) {
+		// Only fails if the counter would overflow, in which case the main
+		// loop is going to wake up anyway.
+	}
+}
+
+// Takes the job that goes with a post to pending, which has already been
+// waited for. There's a job for every post, but if another push is still
+// under way in front of it, it can't be popped quite yet.
+static struct oguri_job * take_job(struct oguri_workers * workers) {
+	struct oguri_job * job;
+	while (!(job = queue_pop(&workers->jobs))) {
+		sched_yield();
+	}
+	return job;
+}
+
+static void * worker_main(void * data) {
+	struct oguri_workers * workers = data;
+	for (;;) {
+		while (sem_wait(&workers->pending) != 0) {
+			// Interrupted, go back to sleep.
+		}
+		if (atomic_load(&workers->stop)) {
+			return NULL;
+		}
+		run_job(workers, take_job(workers));
+	}
+}
+
+struct oguri_workers * oguri_workers_create(unsigned int count) {
+	struct oguri_workers * workers = calloc(1, sizeof(struct oguri_workers));
+	if (!workers) {
+		return NULL;
+	}
+
+	queue_init(&workers->jobs);
+	queue_init(&workers->done);
+	atomic_init(&workers->stop, false);
+	pthread_mutex_init(&workers->finished_mutex, NULL);
+	pthread_cond_init(&workers->finished_cond, NULL);
+
+	workers->done_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (workers->done_fd < 0 || sem_init(&workers->pending, 0, 0) != 0) {
+		fprintf(stderr, "Unable to set up worker threads: %s\n",
+				strerror(errno));
+		if (workers->done_fd >= 0) {
+			close(workers->done_fd);
+		}
+		free(workers);
+		return NULL;
+	}
+
+	workers->threads = calloc(count, sizeof(pthread_t));
+	if (!workers->threads) {
+		oguri_workers_destroy(workers);
+		return NULL;
+	}
+
+	// Signals are left to the main thread, which is the one that handles
+	// them. Threads inherit the mask they were created with.
+	sigset_t all, previous;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &previous);
+	for (; workers->thread_count < count; ++workers->thread_count) {
+		int error = pthread_create(&workers->threads[workers->thread_count],
+				NULL, worker_main, workers);
+		if (error) {
+			fprintf(stderr, "Unable to start worker thread: %s\n",
+					strerror(error));
+			break;
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+	if (workers->thread_count == 0) {
+		oguri_workers_destroy(workers);
+		return NULL;
+	}
+	return workers;
+}
+
+// Stops the threads once they've finished what they're doing, and hands back
+// any jobs which were done in the meantime. Jobs which haven't started yet
+// never will.
+void oguri_workers_destroy(struct oguri_workers * workers) {
+	atomic_store(&workers->stop, true);
+	for (unsigned int i = 0; i < workers->thread_count; ++i) {
+		sem_post(&workers->pending);
+	}
+	for (unsigned int i = 0; i < workers->thread_count; ++i) {
+		pthread_join(workers->threads[i], NULL);
+	}
+
+	oguri_workers_collect(workers);
+
+	// Tickets left over from oguri_workers_run have all been claimed, and
+	// only need letting go of.
+	struct oguri_job * job;
+	while ((job = queue_pop(&workers->jobs))) {
+		if (!job->done) {
+			job->run(job);
+		}
+	}
+
+	close(workers->done_fd);
+	sem_destroy(&workers->pending);
+	pthread_cond_destroy(&workers->finished_cond);
+	pthread_mutex_destroy(&workers->finished_mutex);
+	free(workers->threads);
+	free(workers);
+}
+
+// Becomes readable when there are finished jobs to collect.
+int oguri_workers_get_fd(struct oguri_workers * workers) {
+	return workers->done_fd;
+}
+
+unsigned int oguri_workers_get_count(struct oguri_workers * workers) {
+	return workers->thread_count;
+}
+
+bool oguri_workers_submit(
+		struct oguri_workers * workers, struct oguri_job * job) {
+	if (!queue_push(&workers->jobs, job)) {
+		return false;
+	}
+	sem_post(&workers->pending);
+	return true;
+}
+
+//
+// Splitting work between threads
+//
+// oguri_workers_run queues a ticket for each of its jobs rather than the job
+// itself. Whichever of the caller or a worker claims a ticket first runs its
+// job, and the other passes over it. That lets the caller get on with any
+// jobs no worker has got to yet, and then return as soon as they've all run,
+// without waiting for the workers to get around to the rest of the tickets.
+// The tickets are let go of by whoever is last to be done with them.
+//
+
+struct oguri_batch;
+
+struct oguri_ticket {
+	struct oguri_job job;
+	atomic_bool claimed;
+	struct oguri_job * target;
+	struct oguri_batch * batch;
+};
+
+struct oguri_batch {
+	struct oguri_workers * workers;
+	atomic_uint references;  // The caller, and each ticket still queued.
+	struct oguri_ticket tickets[];
+};
+
+static void release_batch(struct oguri_batch * batch) {
+	if (atomic_fetch_sub_explicit(
+				&batch->references, 1, memory_order_acq_rel) == 1) {
+		free(batch);
+	}
+}
+
+static bool claim_ticket(struct oguri_ticket * ticket) {
+	return !atomic_exchange_explicit(
+			&ticket->claimed, true, memory_order_acquire);
+}
+
+// Runs on a worker, which is done with the ticket once it has passed over it
+// or run its job.
+static void run_ticket(struct oguri_job * job) {
+	struct oguri_ticket * ticket = (struct oguri_ticket *)job;
+	struct oguri_batch * batch = ticket->batch;
+	if (claim_ticket(ticket)) {
+		struct oguri_workers * workers = batch->workers;
+		struct oguri_job * target = ticket->target;
+		target->run(target);
+
+		// The caller may return as soon as it sees this, so target isn't
+		// touched again.
+		atomic_store_explicit(&target->finished, true, memory_order_release);
+		pthread_mutex_lock(&workers->finished_mutex);
+		pthread_cond_broadcast(&workers->finished_cond);
+		pthread_mutex_unlock(&workers->finished_mutex);
+	}
+	release_batch(batch);
+}
+
+// Blocks until a worker has finished running the job.
+static void wait_for_job(
+		struct oguri_workers * workers, struct oguri_job * job) {
+	if (atomic_load_explicit(&job->finished, memory_order_acquire)) {
+		return;
+	}
+
+	pthread_mutex_lock(&workers->finished_mutex);
+	while (!atomic_load_explicit(&job->finished, memory_order_acquire)) {
+		pthread_cond_wait(&workers->finished_cond, &workers->finished_mutex);
+	}
+	pthread_mutex_unlock(&workers->finished_mutex);
+}
+
+// Runs the jobs, which have no done callbacks, and returns once they all
+// have. The first one runs on the calling thread, and the rest on whichever
+// workers are free. Once it's done with the first, the calling thread runs
+// any of the rest that no worker has started on yet, and then sleeps until
+// the workers have finished the others. Other jobs in the queue are left to
+// the workers.
+void oguri_workers_run(struct oguri_workers * workers,
+		struct oguri_job ** jobs, unsigned int count) {
+	if (count < 1) {
+		return;
+	}
+	struct oguri_batch * batch = malloc(sizeof(struct oguri_batch) +
+			(count - 1) * sizeof(struct oguri_ticket));
+	if (!batch) {
+		for (unsigned int i = 0; i < count; ++i) {
+			jobs[i]->run(jobs[i]);  // There's always this thread.
+		}
+		return;
+	}
+
+	batch->workers = workers;
+	atomic_init(&batch->references, 1);
+	for (unsigned int i = 1; i < count; ++i) {
+		struct oguri_ticket * ticket = &batch->tickets[i - 1];
+		ticket->job.run = run_ticket;
+		ticket->job.done = NULL;
+		atomic_init(&ticket->claimed, false);
+		ticket->target = jobs[i];
+		ticket->batch = batch;
+		atomic_store_explicit(&jobs[i]->finished, false, memory_order_relaxed);
+
+		atomic_fetch_add_explicit(&batch->references, 1, memory_order_relaxed);
+		if (!queue_push(&workers->jobs, &ticket->job)) {
+			// Can't happen, but the ticket is left for this thread.
+			atomic_fetch_sub_explicit(
+					&batch->references, 1, memory_order_relaxed);
+			continue;
+		}
+		sem_post(&workers->pending);
+	}
+	jobs[0]->run(jobs[0]);
+
+	for (unsigned int i = 1; i < count; ++i) {
+		if (claim_ticket(&batch->tickets[i - 1])) {
+			jobs[i]->run(jobs[i]);
+			atomic_store_explicit(
+					&jobs[i]->finished, true, memory_order_relaxed);
+		}
+	}
+	for (unsigned int i = 1; i < count; ++i) {
+		wait_for_job(workers, jobs[i]);
+	}
+	release_batch(batch);
+}
+
+// Calls the done callback of every job which has finished since last time.
+// Those may well submit more jobs.
+void oguri_workers_collect(struct oguri_workers * workers) {
+	uint64_t count;
+	if (read(workers->done_fd, &count, sizeof(count)) < 0) {
+		// Nothing new, but there might be some left over from a wait.
+	}
+
+	struct oguri_job * job;
+	while ((job = queue_pop(&workers->done))) {
+		job->done(job);
+	}
+}
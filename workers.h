@@ -0,0 +1,34 @@
+#ifndef OGURI_WORKERS_H
+#define OGURI_WORKERS_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
+struct oguri_job;
+typedef void oguri_job_fn(struct oguri_job * job);
+
+// Something for a worker thread to do. run is called on whichever worker
+// picks the job up, and then done is called back on the main thread by
+// oguri_workers_collect. The job mustn't be freed or submitted again until
+// done has been called. Jobs handed to oguri_workers_run have no done
+// callback, and are finished with when that returns.
+struct oguri_job {
+	oguri_job_fn * run;
+	oguri_job_fn * done;
+	atomic_bool finished;  // For oguri_workers_run, run has returned.
+};
+
+struct oguri_workers;
+
+struct oguri_workers * oguri_workers_create(unsigned int count);
+void oguri_workers_destroy(struct oguri_workers * workers);
+int oguri_workers_get_fd(struct oguri_workers * workers);
+unsigned int oguri_workers_get_count(struct oguri_workers * workers);
+
+bool oguri_workers_submit(
+		struct oguri_workers * workers, struct oguri_job * job);
+void oguri_workers_run(struct oguri_workers * workers,
+		struct oguri_job ** jobs, unsigned int count);
+void oguri_workers_collect(struct oguri_workers * workers);
+
+#endif